@@ -0,0 +1,392 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// Times every verb of openvpn-db against a database built by gen.sh. Each
+// operation is one process, as the tool is used from scripts, so latencies
+// include exec and opening the database. Afterwards STREAM-MB of data are
+// streamed through non-blocking pipes into put-file and back out of
+// get-file and checked to arrive intact.
+//
+// usage: bench <OPENVPN-DB> <DB> [ITERATIONS [STREAM-MB]]
+
+#define MAX_ARGS 8
+
+const char *tool;
+const char *db;
+int iterations = 200;
+long stream_mb = 0;
+
+char **configs;
+size_t n_configs;
+char **files;
+size_t n_files;
+
+// Inputs of the verbs reading stdin.
+const char *conf_path = "/tmp/openvpn-db-bench.conf";
+const char *file_path = "/tmp/openvpn-db-bench.file";
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Starts the tool with stdin and stdout connected to the descriptors, -1
+// for /dev/null, and returns its pid.
+pid_t spawn(const char *const args[], int in_fd, int out_fd) {
+	const char *argv[MAX_ARGS + 3] = { tool };
+	int i;
+
+	for ( i = 0; args[i] != NULL && i < MAX_ARGS; i++ )
+		argv[i + 1] = args[i];
+	argv[i + 1] = NULL;
+
+	pid_t pid = fork();
+	if ( pid < 0 ) {
+		perror("failed to fork");
+		exit(EX_OSERR);
+	}
+	if ( pid == 0 ) {
+		if ( in_fd < 0 )
+			in_fd = open("/dev/null", O_RDONLY);
+		if ( out_fd < 0 )
+			out_fd = open("/dev/null", O_WRONLY);
+		if ( in_fd < 0 || out_fd < 0 || dup2(in_fd, STDIN_FILENO) < 0 || dup2(out_fd, STDOUT_FILENO) < 0 )
+			_exit(EX_OSERR);
+		execv(tool, (char *const*) argv);
+		_exit(EX_UNAVAILABLE);
+	}
+	return pid;
+}
+
+int wait_for(pid_t pid) {
+	int status;
+
+	while ( waitpid(pid, &status, 0) < 0 ) {
+		if ( errno != EINTR ) {
+			perror("failed to wait for child");
+			exit(EX_OSERR);
+		}
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EX_SOFTWARE;
+}
+
+// Runs the tool with stdin from in (or /dev/null) and stdout discarded and
+// returns its exit status.
+int run(const char *const args[], const char *in) {
+	int in_fd = -1;
+
+	if ( in != NULL && (in_fd = open(in, O_RDONLY)) < 0 ) {
+		fprintf(stderr, "failed to open %s : %s\n", in, strerror(errno));
+		exit(EX_NOINPUT);
+	}
+	int status = wait_for(spawn(args, in_fd, -1));
+	if ( in_fd >= 0 )
+		close(in_fd);
+	return status;
+}
+
+// Reads the names printed by a listing verb, the last tab separated column
+// of each line.
+char **list(const char *verb, size_t *n) {
+	char cmd[4096], *line = NULL, **names = NULL;
+	size_t cap = 0, names_cap = 0;
+	ssize_t len;
+
+	snprintf(cmd, sizeof(cmd), "'%s' %s '%s'", tool, verb, db);
+	FILE *in = popen(cmd, "r");
+	if ( in == NULL ) {
+		perror("failed to run the tool");
+		exit(EX_OSERR);
+	}
+	*n = 0;
+	while ( (len = getline(&line, &cap, in)) > 0 ) {
+		if ( line[len - 1] == '\n' )
+			line[len - 1] = '\0';
+		const char *name = strrchr(line, '\t') != NULL ? strrchr(line, '\t') + 1 : line;
+		if ( *n == names_cap && (names = realloc(names, (names_cap = names_cap ? names_cap * 2 : 1024) * sizeof(char*))) == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			exit(EX_OSERR);
+		}
+		if ( (names[(*n)++] = strdup(name)) == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			exit(EX_OSERR);
+		}
+	}
+	free(line);
+	pclose(in);
+	return names;
+}
+
+int cmp_double(const void *a, const void *b) {
+	const double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+typedef struct bench {
+	const char *verb;
+	// Fills args for the i-th run, returns the stdin to use.
+	const char *(*setup)(int i, const char *args[MAX_ARGS + 1], char *buf);
+} bench_t;
+
+const char *config(int i) { return configs[(size_t) rand() % n_configs]; }
+const char *file(int i)   { return files[(size_t) rand() % n_files]; }
+
+#define ARGS(...) do { const char *const a[] = { __VA_ARGS__, NULL }; memcpy(args, a, sizeof(a)); } while (0)
+
+const char *get_(int i, const char *args[], char *buf)         { ARGS("get", db, config(i), "param0"); return NULL; }
+const char *get_many(int i, const char *args[], char *buf)     { ARGS("get", db, config(i), "param0", "param1", "param2", "ca"); return NULL; }
+const char *show(int i, const char *args[], char *buf)         { ARGS("show", db, config(i)); return NULL; }
+const char *list_(int i, const char *args[], char *buf)        { ARGS("list", db); return NULL; }
+const char *list_files(int i, const char *args[], char *buf)   { ARGS("list-files", db); return NULL; }
+const char *list_page(int i, const char *args[], char *buf)    { ARGS("list-files", db, "--prefix", file(i), "--limit", "20"); return NULL; }
+const char *find(int i, const char *args[], char *buf)         { ARGS("find", db, "param0", "--like", "%-1%"); return NULL; }
+const char *users_of(int i, const char *args[], char *buf)     { ARGS("users-of", db, file(i), "--count"); return NULL; }
+const char *get_file(int i, const char *args[], char *buf)     { ARGS("get-file", db, file(i)); return NULL; }
+const char *tar(int i, const char *args[], char *buf)          { ARGS("tar", db, config(i), "none"); return NULL; }
+const char *render(int i, const char *args[], char *buf)       { ARGS("render", db, config(i)); return NULL; }
+
+const char *read_(int i, const char *args[], char *buf) {
+	snprintf(buf, 64, "bench-conf%i", i);
+	ARGS("read", db, buf);
+	return conf_path;
+}
+
+// Re-applies the same config, after the first run nothing changes.
+const char *read_sync(int i, const char *args[], char *buf) {
+	ARGS("read", db, "bench-conf0", "--sync");
+	return conf_path;
+}
+
+const char *put_file(int i, const char *args[], char *buf) {
+	snprintf(buf, 64, "bench-file%i", i);
+	ARGS("put-file", db, buf);
+	return file_path;
+}
+
+// Deletes the files stored by put-file.
+const char *delete_file(int i, const char *args[], char *buf) {
+	snprintf(buf, 64, "bench-file%i", i);
+	ARGS("delete-file", db, buf);
+	return NULL;
+}
+
+const bench_t benches[] = {
+	{ "get",         get_ },
+	{ "get (4)",     get_many },
+	{ "show",        show },
+	{ "list",        list_ },
+	{ "find",        find },
+	{ "read",        read_ },
+	{ "read --sync", read_sync },
+	{ "put-file",    put_file },
+	{ "get-file",    get_file },
+	{ "list-files",  list_files },
+	{ "files (page)", list_page },
+	{ "users-of",    users_of },
+	{ "delete-file", delete_file },
+	{ "tar",         tar },
+	{ "render",      render }
+};
+
+// xorshift64*, the stream check regenerates the data instead of keeping a
+// copy of it.
+typedef struct pattern {
+	uint64_t state;
+} pattern_t;
+
+void fill_pattern(pattern_t *p, uint8_t *buf, size_t len) {
+	for ( size_t i = 0; i < len; i += 8 ) {
+		p->state ^= p->state >> 12;
+		p->state ^= p->state << 25;
+		p->state ^= p->state >> 27;
+		uint64_t word = p->state * 2685821657736338717ull;
+		memcpy(buf + i, &word, len - i < 8 ? len - i : 8);
+	}
+}
+
+// Creates a pipe whose end for the tool, fds[tool_end], is non-blocking.
+// The end kept by the bench is closed on exec, so the tool sees EOF.
+void open_pipe(int fds[2], int tool_end) {
+	int flags;
+
+	if ( pipe(fds) ) {
+		perror("failed to create pipe");
+		exit(EX_OSERR);
+	}
+	if ( (flags = fcntl(fds[tool_end], F_GETFL)) < 0 || fcntl(fds[tool_end], F_SETFL, flags | O_NONBLOCK) < 0 ||
+	     fcntl(fds[!tool_end], F_SETFD, FD_CLOEXEC) < 0 ) {
+		perror("failed to set up pipe");
+		exit(EX_OSERR);
+	}
+}
+
+// Streams stream_mb MiB into put-file --chunked with its stdin a
+// non-blocking pipe and reads them back from get-file with its stdout one,
+// on a database of its own next to db. Returns 0 if the data came back
+// intact.
+int stream_check(void) {
+	const uint64_t size = (uint64_t) stream_mb * 1024 * 1024;
+	uint8_t buf[64 * 1024], expected[sizeof(buf)];
+	char stream_db[4096];
+	int fds[2], status;
+
+	snprintf(stream_db, sizeof(stream_db), "%s.stream", db);
+	unlink(stream_db);
+	const char *put_args[] = { "put-file", stream_db, "bench-stream", "--chunked", NULL };
+	const char *get_args[] = { "get-file", stream_db, "bench-stream", NULL };
+
+	// A put-file failing early shows in its exit status.
+	signal(SIGPIPE, SIG_IGN);
+	open_pipe(fds, 0);
+	double start = now();
+	pid_t pid = spawn(put_args, fds[0], -1);
+	close(fds[0]);
+	pattern_t out = { 88172645463325252ull };
+	for ( uint64_t left = size; left > 0; ) {
+		size_t n = left < sizeof(buf) ? left : sizeof(buf);
+		fill_pattern(&out, buf, n);
+		size_t i = 0;
+		while ( i < n ) {
+			ssize_t delta = write(fds[1], buf + i, n - i);
+			if ( delta < 0 && errno != EINTR )
+				break;
+			if ( delta > 0 )
+				i += delta;
+		}
+		if ( i < n )
+			break;
+		left -= n;
+	}
+	close(fds[1]);
+	if ( (status = wait_for(pid)) != 0 ) {
+		printf("%-12s failed with exit status %i\n", "stream put", status);
+		unlink(stream_db);
+		return 1;
+	}
+	printf("%-12s %10.1f MB/s\n", "stream put", size / (now() - start) / 1e6);
+
+	open_pipe(fds, 1);
+	start = now();
+	pid = spawn(get_args, -1, fds[1]);
+	close(fds[1]);
+	pattern_t in = { 88172645463325252ull };
+	uint64_t got = 0;
+	int intact = 1;
+	ssize_t delta;
+	while ( (delta = read(fds[0], buf, sizeof(buf))) != 0 ) {
+		if ( delta < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			perror("failed to read from get-file");
+			exit(EX_IOERR);
+		}
+		// Reads end anywhere, compare against the pattern in its blocks.
+		for ( size_t i = 0; i < (size_t) delta && intact; ) {
+			size_t at = got % sizeof(expected);
+			if ( at == 0 )
+				fill_pattern(&in, expected, size - got < sizeof(expected) ? size - got : sizeof(expected));
+			size_t n = sizeof(expected) - at < (size_t) delta - i ? sizeof(expected) - at : (size_t) delta - i;
+			if ( got + n > size || memcmp(buf + i, expected + at, n) != 0 )
+				intact = 0;
+			got += n;
+			i += n;
+		}
+	}
+	close(fds[0]);
+	status = wait_for(pid);
+	unlink(stream_db);
+	if ( status != 0 ) {
+		printf("%-12s failed with exit status %i\n", "stream get", status);
+		return 1;
+	}
+	printf("%-12s %10.1f MB/s\n", "stream get", size / (now() - start) / 1e6);
+	if ( !intact || got != size ) {
+		printf("%-12s data corrupted after %llu of %llu bytes\n", "stream", (unsigned long long) got, (unsigned long long) size);
+		return 1;
+	}
+	return 0;
+}
+
+void write_input(const char *path, const char *text, size_t repeat) {
+	FILE *out = fopen(path, "w");
+	if ( out == NULL ) {
+		fprintf(stderr, "failed to create %s : %s\n", path, strerror(errno));
+		exit(EX_CANTCREAT);
+	}
+	for ( size_t i = 0; i < repeat; i++ )
+		fputs(text, out);
+	fclose(out);
+}
+
+int main(int argc, const char *argv[]) {
+	if ( argc < 3 || argc > 5 ) {
+		fprintf(stderr, "usage: %s <OPENVPN-DB> <DB> [ITERATIONS [STREAM-MB]]\n", argv[0]);
+		return EX_USAGE;
+	}
+	tool = argv[1];
+	db = argv[2];
+	if ( (argc >= 4 && (iterations = atoi(argv[3])) < 1) || (argc == 5 && (stream_mb = atol(argv[4])) < 0) ) {
+		fprintf(stderr, "usage: %s <OPENVPN-DB> <DB> [ITERATIONS [STREAM-MB]]\n", argv[0]);
+		return EX_USAGE;
+	}
+
+	configs = list("list", &n_configs);
+	files = list("list-files", &n_files);
+	if ( n_configs == 0 || n_files == 0 ) {
+		fputs("the database needs configs and files, see gen.sh.\n", stderr);
+		return EX_DATAERR;
+	}
+	write_input(conf_path, "dev tun\nproto udp\nremote vpn.example.com 1194\nverb 3\n", 1);
+	write_input(file_path, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde\n", 64);
+	srand(1);
+
+	double *latencies = malloc(iterations * sizeof(double));
+	if ( latencies == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		return EX_OSERR;
+	}
+
+	int failed = 0;
+	printf("%-12s %10s %10s %10s\n", "verb", "ops/s", "p50 ms", "p99 ms");
+	for ( size_t b = 0; b < sizeof(benches) / sizeof(*benches); b++ ) {
+		double total = 0;
+		int status = 0;
+		for ( int i = 0; i < iterations && status == 0; i++ ) {
+			const char *args[MAX_ARGS + 1];
+			char buf[64];
+			const char *in = benches[b].setup(i, args, buf);
+			double start = now();
+			status = run(args, in);
+			latencies[i] = now() - start;
+			total += latencies[i];
+		}
+		if ( status != 0 ) {
+			printf("%-12s failed with exit status %i\n", benches[b].verb, status);
+			failed = 1;
+			continue;
+		}
+		qsort(latencies, iterations, sizeof(double), cmp_double);
+		printf("%-12s %10.1f %10.3f %10.3f\n", benches[b].verb, iterations / total,
+		       latencies[iterations / 2] * 1e3, latencies[iterations * 99 / 100] * 1e3);
+		fflush(stdout);
+	}
+
+	if ( stream_mb > 0 && stream_check() )
+		failed = 1;
+
+	unlink(conf_path);
+	unlink(file_path);
+	free(latencies);
+	return failed ? EX_SOFTWARE : 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Builds a synthetic database for the benchmarks by writing an OpenVPN tree
+# and importing it with import-dir.
+#
+# usage: gen.sh <OPENVPN-DB> <DB> <CONFIGS> <PARAMS> <FILES> <SIZE> <EDGES> <SHARED>
+#
+#   CONFIGS  number of client configs (ccd/client<N>)
+#   PARAMS   params per config besides the file references
+#   FILES    number of files below pki/
+#   SIZE     bytes per file
+#   EDGES    files attached per config, at most 9 (one per file param)
+#   SHARED   percentage of attachments pointing to the first EDGES files,
+#            shared by every config like a CA, the rest point to the others
+set -eu
+
+if [ $# -ne 8 ]; then
+	sed -n '5,14s/^# \{0,1\}//p' "$0" >&2
+	exit 64
+fi
+TOOL=$1 DB=$2 CONFIGS=$3 PARAMS=$4 FILES=$5 SIZE=$6 EDGES=$7 SHARED=$8
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/openvpn-db-bench.XXXXXX")
+trap 'rm -rf "$DIR"' EXIT
+mkdir -p "$DIR/ccd" "$DIR/pki"
+
+awk -v dir="$DIR" -v configs="$CONFIGS" -v params="$PARAMS" -v files="$FILES" \
+    -v size="$SIZE" -v edges="$EDGES" -v shared="$SHARED" 'BEGIN {
+	split("ca cert dh extra-certs key pkcs12 tls-auth tls-crypt tls-crypt-v2", tags, " ")
+	if ( edges > 9 )
+		edges = 9
+	srand(1)
+
+	line = ""
+	for ( i = 0; i < 64; i++ )
+		line = line substr("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/", int(rand() * 64) + 1, 1)
+	for ( f = 0; f < files; f++ ) {
+		path = dir "/pki/f" f
+		head = sprintf("file %d\n", f)
+		printf "%s", head > path
+		for ( left = size - length(head); left > 0; left -= 65 )
+			printf "%s\n", (left >= 65 ? line : substr(line, 1, left - 1)) > path
+		close(path)
+	}
+
+	for ( c = 0; c < configs; c++ ) {
+		path = dir "/ccd/client" c
+		for ( p = 0; p < params; p++ )
+			printf "param%d value-%d-%d\n", p, c, p > path
+		for ( e = 0; e < edges && e < files; e++ ) {
+			if ( files <= edges || rand() * 100 < shared )
+				f = e
+			else
+				f = edges + int(rand() * (files - edges))
+			printf "%s pki/f%d\n", tags[e + 1], f > path
+		}
+		close(path)
+	}
+}'
+
+rm -f "$DB"
+"$TOOL" import-dir "$DB" "$DIR"
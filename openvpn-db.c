@@ -1,21 +1,37 @@
 #include <errno.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <inttypes.h>
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <openssl/evp.h>
 #include <sqlite3.h>
+#include <zdict.h>
+#include <zstd.h>
 
 typedef enum { init, show, read_, get, list,
-	put_file, get_file, delete_file, list_files,
-	attach_file, detach_file, list_attached,
-	tar
+	put_file, put_files_, get_file, delete_file, list_files,
+	attach_file, detach_file, list_attached, find_, users_of_,
+	tar, export_all_, export_, render_, render_all_, import_dir_, concurrency,
+	train_dict_, fsck_,
+	serve_, query_, explain_, batch_
 } verb_t;
 
 typedef struct named_verb {
@@ -27,25 +43,131 @@ verb_t verb = 0;
 const char *db_path = NULL;
 sqlite3 *db = NULL;
 
+// Set while a batch command runs, failures return to the batch loop
+// instead of terminating the process.
+jmp_buf *fail_env = NULL;
+
+void fail(int status) {
+	if ( fail_env != NULL )
+		longjmp(*fail_env, status);
+	exit(status);
+}
+
+// Heap memory a verb holds while it may fail. The batch loop releases what
+// is still registered after a failed command, newest first, so a long batch
+// doesn't leak the buffers of its failed commands. Registered are the
+// variables, buffers grown by getline() or a memory stream stay covered.
+typedef struct owned {
+	void **ref;
+	void (*release)(void*);
+} owned_t;
+
+#define MAX_OWNED 8
+owned_t owned[MAX_OWNED];
+int     n_owned = 0;
+
+#define OWN(var, fn) own((void**) &(var), fn)
+
+void own(void **ref, void (*release)(void*)) {
+	if ( n_owned == MAX_OWNED ) {
+		fputs("too many buffers registered for cleanup.\n", stderr);
+		exit(EX_SOFTWARE);
+	}
+	owned[n_owned++] = (owned_t) { .ref = ref, .release = release };
+}
+
+// Forgets the newest n registrations once their owner freed them itself.
+void disown(int n) {
+	n_owned -= n;
+}
+
+void release_owned(void) {
+	while ( n_owned > 0 ) {
+		owned_t *o = &owned[--n_owned];
+		if ( *o->ref != NULL )
+			o->release(*o->ref);
+		*o->ref = NULL;
+	}
+}
+
+void close_stream(void *stream) {
+	fclose(stream);
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --stats before the verb or OPENVPN_DB_STATS in the environment print where
+// a command spent its time as a JSON object on stderr when the database is
+// closed. Only the main thread updates the counters.
+typedef struct stats {
+	int            enabled;
+	const char    *verb;
+	double         started;
+	double         open, schema, prepare, step, blob_io, output; // seconds
+	sqlite3_int64  copied, blob_written, blob_read;             // bytes
+	sqlite3_int64  streamed;                                   // bytes read ahead
+	double         stream_time;                                // seconds
+} stats_t;
+
+stats_t stats = { 0 };
+
+// Returns the time to measure a phase from, 0 if stats are disabled so the
+// phase stays 0 as well.
+double stats_clock(void) {
+	return stats.enabled ? now() : 0;
+}
+
+// sqlite3_step() timed as the step phase, commit() adds the commit to it.
+// Statements of worker connections aren't timed, the counters belong to the
+// main thread.
+int step(sqlite3_stmt *stmt) {
+	if ( !stats.enabled || sqlite3_db_handle(stmt) != db )
+		return sqlite3_step(stmt);
+
+	const double t = now();
+	const int r = sqlite3_step(stmt);
+	stats.step += now() - t;
+	return r;
+}
 
 void usage(const char *name) {
 	fprintf(stderr, "usage: %s init          <DB>\n", name);
 	fprintf(stderr, "       %s show          <DB> <NAME>\n", name);
-	fprintf(stderr, "       %s read          <DB> <NAME>\n", name);
-	fprintf(stderr, "       %s get           <DB> <NAME> <PARAM>\n", name);
+	fprintf(stderr, "       %s read          <DB> <NAME> [--sync]\n", name);
+	fprintf(stderr, "       %s get           <DB> <NAME> [--null] <PARAM>...\n", name);
 	fprintf(stderr, "       %s list          <DB>\n", name);
 	
-	fprintf(stderr, "       %s put-file      <DB> <FILE>\n", name);
-	fprintf(stderr, "       %s get-file      <DB> <FILE>\n", name);
+	fprintf(stderr, "       %s put-file      <DB> <FILE> [--size BYTES] [--chunked] [--compress]\n", name);
+	fprintf(stderr, "       %s put-files     <DB> [--attach NAME]\n", name);
+	fprintf(stderr, "       %s get-file      <DB> <FILE> [--offset BYTES] [--length BYTES] [--out PATH]\n", name);
 	fprintf(stderr, "       %s delete-file   <DB> <FILE>\n", name);
-	fprintf(stderr, "       %s list-files    <DB>\n", name);
+	fprintf(stderr, "       %s list-files    <DB> [--prefix PREFIX] [--limit N] [--after FILE]\n", name);
+	fprintf(stderr, "       %s train-dict    <DB> [--size BYTES]\n", name);
 
 	fprintf(stderr, "       %s attach-file   <DB> <NAME> <FILE>\n", name);
 	fprintf(stderr, "       %s detach-file   <DB> <NAME> <FILE>\n", name);
 	fprintf(stderr, "       %s list-attached <DB> <NAME>\n", name);
+	fprintf(stderr, "       %s find          <DB> <PARAM> [VALUE|--like PATTERN] [--count]\n", name);
+	fprintf(stderr, "       %s users-of      <DB> <FILE> [--count]\n", name);
 
-	fprintf(stderr, "       %s tar           <DB> <NAME>\n", name);
-	exit(EX_USAGE);
+	fprintf(stderr, "       %s tar           <DB> <NAME> [none|gzip|zstd]\n", name);
+	fprintf(stderr, "       %s export-all    <DB> [none|gzip|zstd]\n", name);
+	fprintf(stderr, "       %s export        <DB> --since GEN [none|gzip|zstd]\n", name);
+	fprintf(stderr, "       %s render        <DB> <NAME>\n", name);
+	fprintf(stderr, "       %s render-all    <DB> <OUTDIR> [--jobs N]\n", name);
+	fprintf(stderr, "       %s import-dir    <DB> <DIR> [--jobs N]\n", name);
+	fprintf(stderr, "       %s concurrency   <DB> [on|off] [--busy-timeout MS] [--mmap-size BYTES]\n", name);
+	fprintf(stderr, "       %s serve         <DB> <SOCKET>\n", name);
+	fprintf(stderr, "       %s query         <SOCKET> <get|show|list-attached> <NAME> [PARAM]\n", name);
+	fprintf(stderr, "       %s fsck          <DB> [--jobs N] [--repair]\n", name);
+	fprintf(stderr, "       %s explain       <DB> <SQL>\n", name);
+	fprintf(stderr, "       %s batch         <DB> [COMMIT-EVERY]\n", name);
+	fprintf(stderr, "       %s --stats       <VERB> ...\n", name);
+	fail(EX_USAGE);
 }
 
 int cmp_verb(const void *a, const void *b) {
@@ -58,14 +180,30 @@ int get_verb(const char *name) {
 	const named_verb_t verbs[] = { // keep sorted
 		{ .name = "attach-file",
 		  .verb = attach_file },
+		{ .name = "batch",
+		  .verb = batch_ },
+		{ .name = "concurrency",
+		  .verb = concurrency },
 		{ .name = "delete-file",
 		  .verb = delete_file },
 		{ .name = "detach-file",
 		  .verb = detach_file },
+		{ .name = "explain",
+		  .verb = explain_ },
+		{ .name = "export",
+		  .verb = export_ },
+		{ .name = "export-all",
+		  .verb = export_all_ },
+		{ .name = "find",
+		  .verb = find_ },
+		{ .name = "fsck",
+		  .verb = fsck_ },
 		{ .name = "get",
 		  .verb = get },
 		{ .name = "get-file",
 		  .verb = get_file },
+		{ .name = "import-dir",
+		  .verb = import_dir_ },
 		{ .name = "init",
 		  .verb = init },
 		{ .name = "list",
@@ -76,12 +214,26 @@ int get_verb(const char *name) {
 		  .verb = list_files },
 		{ .name = "put-file",
 		  .verb = put_file },
+		{ .name = "put-files",
+		  .verb = put_files_ },
+		{ .name = "query",
+		  .verb = query_ },
 		{ .name = "read",
 		  .verb = read_ },
+		{ .name = "render",
+		  .verb = render_ },
+		{ .name = "render-all",
+		  .verb = render_all_ },
+		{ .name = "serve",
+		  .verb = serve_ },
 		{ .name = "show",
 		  .verb = show },
 		{ .name = "tar",
-		  .verb = tar }
+		  .verb = tar },
+		{ .name = "train-dict",
+		  .verb = train_dict_ },
+		{ .name = "users-of",
+		  .verb = users_of_ }
 	};
 	const named_verb_t key = { .name = name, .verb = 0 };
 	const named_verb_t *const found = (const named_verb_t*) bsearch(&key, &verbs, sizeof(verbs) / sizeof(named_verb_t), sizeof(named_verb_t), cmp_verb);
@@ -89,10 +241,338 @@ int get_verb(const char *name) {
 	return !found;
 }
 
+// Prepared statements are cached by their SQL text for the lifetime of the
+// connection. Statements are handed out by prepare() and returned with
+// release(). A statement prepared again while still in use gets an uncached
+// copy, so nested users can't reset each other.
+typedef struct cached_stmt {
+	struct cached_stmt *next;
+	sqlite3_stmt       *stmt;
+	int                 busy;
+} cached_stmt_t;
+
+#define STMT_CACHE_SIZE 64
+cached_stmt_t *stmt_cache[STMT_CACHE_SIZE];
+
+// FNV-1a
+unsigned hash_str(const char *s) {
+	unsigned h = 2166136261u;
+	while ( *s )
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+unsigned hash_sql(const char *sql) {
+	return hash_str(sql) % STMT_CACHE_SIZE;
+}
+
+// A statement with a WHERE clause has to find its rows through an index, a
+// full scan (SCAN) or an automatic index in its query plan means an index
+// is missing or unusable. Returns 0 if the plan is fine. The plan is printed
+// to out unless it is NULL.
+int check_plan(sqlite3 *conn, const char *sql, FILE *out) {
+	sqlite3_stmt *explain = NULL;
+	int bad = 0, r;
+
+	char *explain_sql = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+	if ( explain_sql == NULL || sqlite3_prepare_v2(conn, explain_sql, -1, &explain, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to explain statement : %s\n", sqlite3_errmsg(conn));
+		sqlite3_free(explain_sql);
+		return 1;
+	}
+	sqlite3_free(explain_sql);
+
+	const int filtered = strstr(sql, "WHERE") != NULL;
+	while ( (r = sqlite3_step(explain)) == SQLITE_ROW ) {
+		const char *detail = (const char*) sqlite3_column_text(explain, 3);
+		const int is_bad = (filtered && strncmp(detail, "SCAN ", 5) == 0 && strcmp(detail, "SCAN CONSTANT ROW") != 0) ||
+		                   strstr(detail, "AUTOMATIC") != NULL;
+		if ( out != NULL )
+			fprintf(out, "%s%s\n", is_bad ? "! " : "  ", detail);
+		bad |= is_bad;
+	}
+	if ( r != SQLITE_DONE ) {
+		fprintf(stderr, "failed to explain statement : %s\n", sqlite3_errmsg(conn));
+		bad = 1;
+	}
+	sqlite3_finalize(explain);
+	if ( bad && out == NULL )
+		fprintf(stderr, "query plan without index for : %s\n", sql);
+	return bad;
+}
+
+// Set from OPENVPN_DB_CHECK_PLANS in the environment, make bench runs every
+// verb with it to catch statements that lost their index.
+int check_plans = -1;
+
+int prepare(const char *sql, sqlite3_stmt **stmt) {
+	cached_stmt_t **bucket = &stmt_cache[hash_sql(sql)];
+	cached_stmt_t *entry;
+	int r;
+
+	for ( entry = *bucket; entry != NULL; entry = entry->next ) {
+		if ( strcmp(sqlite3_sql(entry->stmt), sql) == 0 )
+			break;
+	}
+	if ( entry != NULL && !entry->busy ) {
+		entry->busy = 1;
+		*stmt = entry->stmt;
+		return SQLITE_OK;
+	}
+
+	if ( check_plans < 0 )
+		check_plans = getenv("OPENVPN_DB_CHECK_PLANS") != NULL;
+	if ( check_plans && entry == NULL && check_plan(db, sql, NULL) )
+		fail(EX_SOFTWARE);
+
+	const double t = stats_clock();
+	r = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+	stats.prepare += stats_clock() - t;
+	if ( r != SQLITE_OK || entry != NULL )
+		return r;
+
+	if ( (entry = malloc(sizeof(cached_stmt_t))) == NULL )
+		return SQLITE_NOMEM;
+	entry->next = *bucket;
+	entry->stmt = *stmt;
+	entry->busy = 1;
+	*bucket = entry;
+	return SQLITE_OK;
+}
+
+void release(sqlite3_stmt *stmt) {
+	cached_stmt_t *entry;
+
+	if ( stmt == NULL )
+		return;
+
+	for ( entry = stmt_cache[hash_sql(sqlite3_sql(stmt))]; entry != NULL; entry = entry->next ) {
+		if ( entry->stmt == stmt ) {
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			entry->busy = 0;
+			return;
+		}
+	}
+	sqlite3_finalize(stmt);
+}
+
+// Resets every cached statement, used to clean up after a failed command.
+void release_all(void) {
+	for ( int i = 0; i < STMT_CACHE_SIZE; i++ ) {
+		for ( cached_stmt_t *entry = stmt_cache[i]; entry != NULL; entry = entry->next ) {
+			if ( entry->busy )
+				release(entry->stmt);
+		}
+	}
+}
+
+void finalize_all(void) {
+	for ( int i = 0; i < STMT_CACHE_SIZE; i++ ) {
+		while ( stmt_cache[i] != NULL ) {
+			cached_stmt_t *entry = stmt_cache[i];
+			stmt_cache[i] = entry->next;
+			sqlite3_finalize(entry->stmt);
+			free(entry);
+		}
+	}
+}
+
+// Concurrent mode is opted into per database with the concurrency verb and
+// stored in the Settings table. It puts the database into WAL mode, so
+// readers no longer block on a writer, and makes each connection wait for
+// locks with a backoff, relax fsyncs to synchronous=NORMAL and read through
+// a memory map.
+int           concurrent   = 0;
+int           busy_timeout = 5000;              // ms
+sqlite3_int64 mmap_size    = 256 * 1024 * 1024; // bytes
+
+void bump_generation(void);
+
+// Verbs use savepoints instead of BEGIN/COMMIT, so they nest inside the
+// transaction of a batch. The outermost savepoint is the transaction, its
+// commit bumps the generation once if anything was written, see
+// bump_generation(). batch holds the outermost level itself.
+//
+// A savepoint starts a deferred transaction. In WAL mode a writer that read
+// first has to upgrade its read transaction, which fails right away without
+// calling the busy handler, so verbs that write start with begin_write()
+// and in concurrent mode take the write lock up front with BEGIN IMMEDIATE.
+int txn_depth     = 0;
+int txn_changes   = 0; // sqlite3_total_changes() when the transaction began
+int txn_immediate = 0; // the transaction was opened with BEGIN IMMEDIATE
+
+int open_verb(int immediate) {
+	if ( sqlite3_get_autocommit(db) ) {
+		if ( immediate ) {
+			const int r = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL);
+			if ( r != SQLITE_OK )
+				return r;
+		}
+		txn_depth = 0;
+		txn_changes = sqlite3_total_changes(db);
+		txn_immediate = immediate;
+	}
+	const int r = sqlite3_exec(db, "SAVEPOINT verb;", NULL, NULL, NULL);
+	if ( r == SQLITE_OK )
+		txn_depth++;
+	return r;
+}
+
+int begin(void) {
+	return open_verb(0);
+}
+
+int begin_write(void) {
+	return open_verb(concurrent);
+}
+
+// The depth only drops once the savepoint is gone. A commit that fails,
+// e.g. with SQLITE_BUSY, leaves the level open for a retry or a rollback.
+// COMMIT also releases the savepoints, so it runs alone.
+int commit(void) {
+	const int depth = txn_depth - 1;
+	if ( depth == 0 )
+		bump_generation();
+	const double t = stats_clock();
+	const int r = sqlite3_exec(db, depth == 0 && txn_immediate ? "COMMIT;" : "RELEASE verb;", NULL, NULL, NULL);
+	stats.step += stats_clock() - t;
+	if ( r == SQLITE_OK )
+		txn_depth = depth;
+	return r;
+}
+
+int rollback(void) {
+	const int depth = txn_depth - 1;
+	const int r = sqlite3_exec(db, depth == 0 && txn_immediate ? "ROLLBACK;" : "ROLLBACK TO verb; RELEASE verb;", NULL, NULL, NULL);
+	if ( r == SQLITE_OK )
+		txn_depth = depth;
+	return r;
+}
+
+// Time spent waiting for locks by the current command.
+double lock_wait = 0;
+
+// Sleeps 1, 2, 4 ... 64 ms and then 100 ms between retries until the busy
+// timeout is spent.
+int busy_backoff(void *arg, int count) {
+	static double started;
+	double t = now();
+
+	if ( count == 0 )
+		started = t;
+	double left = busy_timeout / 1e3 - (t - started);
+	if ( left <= 0 )
+		return 0;
+
+	double delay = count < 7 ? (1 << count) / 1e3 : 0.1;
+	if ( delay > left )
+		delay = left;
+	const struct timespec ts = { .tv_sec = (time_t) delay, .tv_nsec = (long) ((delay - (time_t) delay) * 1e9) };
+	nanosleep(&ts, NULL);
+	lock_wait += now() - t;
+	return 1;
+}
+
+void report_lock_wait(void) {
+	if ( lock_wait > 0 )
+		fprintf(stderr, "waited %.1f ms for the database lock.\n", lock_wait * 1e3);
+	lock_wait = 0;
+}
+
+// Runs before the schema is migrated, a database without a Settings table
+// just keeps the defaults.
+void load_settings(void) {
+	sqlite3_stmt *select_settings = NULL;
+
+	if ( sqlite3_prepare_v2(db, "SELECT Name, Value FROM Settings;", -1, &select_settings, NULL) != SQLITE_OK ) {
+		sqlite3_finalize(select_settings);
+		return;
+	}
+	while ( step(select_settings) == SQLITE_ROW ) {
+		const char *name = (const char*) sqlite3_column_text(select_settings, 0);
+		if ( strcmp(name, "concurrent") == 0 )
+			concurrent = sqlite3_column_int(select_settings, 1);
+		else if ( strcmp(name, "busy-timeout") == 0 )
+			busy_timeout = sqlite3_column_int(select_settings, 1);
+		else if ( strcmp(name, "mmap-size") == 0 )
+			mmap_size = sqlite3_column_int64(select_settings, 1);
+	}
+	sqlite3_finalize(select_settings);
+
+	if ( !concurrent )
+		return;
+
+	char pragmas[128];
+	snprintf(pragmas, sizeof(pragmas), "PRAGMA synchronous = NORMAL; PRAGMA mmap_size = %lli;", mmap_size);
+	sqlite3_busy_handler(db, busy_backoff, NULL);
+	if ( sqlite3_exec(db, pragmas, NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to apply settings : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+}
+
+void json_string(FILE *out, const char *s) {
+	fputc('"', out);
+	for ( ; *s; s++ ) {
+		if ( *s == '"' || *s == '\\' )
+			fprintf(out, "\\%c", *s);
+		else if ( (unsigned char) *s < 0x20 )
+			fprintf(out, "\\u%04x", (unsigned char) *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+// Other is what is left of the wall time after the measured phases: waiting
+// for input, hashing, compression and sleeping on a busy database.
+void print_stats(void) {
+	int hit = 0, miss = 0, writes = 0, unused;
+
+	const double t = now();
+	fflush(stdout);
+	stats.output += now() - t;
+	const double wall = now() - stats.started;
+	const double other = wall - stats.open - stats.schema - stats.prepare - stats.step - stats.blob_io - stats.output;
+
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &hit, &unused, 0);
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &miss, &unused, 0);
+	sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_WRITE, &writes, &unused, 0);
+
+	fputs("{\"verb\":", stderr);
+	json_string(stderr, stats.verb);
+	fprintf(stderr, ",\"wall_ms\":%.3f,\"phases_ms\":{\"open\":%.3f,\"schema\":%.3f,\"prepare\":%.3f,\"step\":%.3f,\"blob_io\":%.3f,\"output\":%.3f,\"other\":%.3f}",
+	        wall * 1e3, stats.open * 1e3, stats.schema * 1e3, stats.prepare * 1e3, stats.step * 1e3, stats.blob_io * 1e3, stats.output * 1e3, other * 1e3);
+	fprintf(stderr, ",\"cache\":{\"hit\":%i,\"miss\":%i,\"write\":%i}", hit, miss, writes);
+	fprintf(stderr, ",\"bytes\":{\"copy_file\":%lli,\"write_blob\":%lli,\"read_blob\":%lli}",
+	        stats.copied, stats.blob_written, stats.blob_read);
+	fprintf(stderr, ",\"stream\":{\"bytes\":%lli,\"ms\":%.3f,\"mb_per_s\":%.1f}",
+	        stats.streamed, stats.stream_time * 1e3, stats.stream_time > 0 ? stats.streamed / stats.stream_time / 1e6 : 0.0);
+	fputs(",\"statements\":[", stderr);
+	for ( int i = 0, first = 1; i < STMT_CACHE_SIZE; i++ ) {
+		for ( cached_stmt_t *entry = stmt_cache[i]; entry != NULL; entry = entry->next, first = 0 ) {
+			fputs(first ? "{\"sql\":" : ",{\"sql\":", stderr);
+			json_string(stderr, sqlite3_sql(entry->stmt));
+			fprintf(stderr, ",\"runs\":%i,\"vm_steps\":%i,\"fullscan_steps\":%i,\"sorts\":%i,\"autoindexes\":%i}",
+			        sqlite3_stmt_status(entry->stmt, SQLITE_STMTSTATUS_RUN, 0),
+			        sqlite3_stmt_status(entry->stmt, SQLITE_STMTSTATUS_VM_STEP, 0),
+			        sqlite3_stmt_status(entry->stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0),
+			        sqlite3_stmt_status(entry->stmt, SQLITE_STMTSTATUS_SORT, 0),
+			        sqlite3_stmt_status(entry->stmt, SQLITE_STMTSTATUS_AUTOINDEX, 0));
+		}
+	}
+	fputs("]}\n", stderr);
+}
+
 void close_db(void) {
 	if ( db == NULL )
 		return;
 
+	report_lock_wait();
+	if ( stats.enabled )
+		print_stats();
+	finalize_all();
 	int n;
 	switch ( n = sqlite3_close(db) ) {
 		case SQLITE_OK: break;
@@ -112,14 +592,36 @@ void get_db(int argc, const char *argv[]) {
 	
 	atexit(close_db);
 	db_path = argv[2];
+	const double t = stats_clock();
 	if ( sqlite3_open(db_path, &db) != SQLITE_OK ) {
 		fprintf(stderr, "failed to open database : %s\n", sqlite3_errmsg(db));
-		exit(EX_IOERR);
+		fail(EX_IOERR);
 	}
+	load_settings();
+	stats.open += stats_clock() - t;
 }
 
-const char *init_sql =
-	"CREATE TABLE IF NOT EXISTS Params (\n"
+void migrate_blobs(void);
+void migrate_types(void);
+
+// migrations[i] upgrades a database from user_version i to i + 1 by running
+// its SQL and then its function, if any. Databases created before the schema
+// was versioned have user_version 0.
+typedef struct migration {
+	const char *sql;
+	void      (*migrate)(void);
+} migration_t;
+
+#define STAMP_TRIGGER(trigger, event, table, row, changes) \
+	"DROP TRIGGER " trigger ";\n" \
+	"CREATE TRIGGER " trigger " AFTER " event " ON " table " BEGIN\n" \
+	"    INSERT INTO " changes " ( Name, Generation ) SELECT " row ".Name, Value + 1 FROM Generation WHERE true\n" \
+	"    ON CONFLICT ( Name ) DO UPDATE SET Generation = excluded.Generation WHERE Generation IS NOT excluded.Generation;\n" \
+	"END;\n"
+
+const migration_t migrations[] = {
+	// 1: base schema without the indexes duplicating the primary keys
+	{ "CREATE TABLE IF NOT EXISTS Params (\n"
 	"    Name  STRING NOT NULL,\n"
 	"    Param STRING NOT NULL,\n"
 	"    Value STRING,\n"
@@ -135,19 +637,206 @@ const char *init_sql =
 	"    File STRING NOT NULL,\n"
 	"    PRIMARY KEY ( Name, File )\n"
 	");\n"
-	"CREATE INDEX IF NOT EXISTS ParamByName    ON Params ( Name  );\n"
-	"CREATE INDEX IF NOT EXISTS ParamByParam   ON Params ( Param );\n"
-	"CREATE INDEX IF NOT EXISTS ParamByPrimary ON Params ( Name, Param );\n"
-	"CREATE INDEX IF NOT EXISTS FileByName     ON Files  ( Name );\n"
-	"CREATE INDEX IF NOT EXISTS EdgeByName     ON Edges  ( Name );\n"
-	"CREATE INDEX IF NOT EXISTS EdgeByFile     ON Edges  ( File );\n"
-	"CREATE INDEX IF NOT EXISTS EdgeByPrimary  ON Edges  ( Name, File );\n";
+	"DROP INDEX IF EXISTS ParamByName;\n"
+	"DROP INDEX IF EXISTS ParamByPrimary;\n"
+	"DROP INDEX IF EXISTS FileByName;\n"
+	"DROP INDEX IF EXISTS EdgeByName;\n"
+	"DROP INDEX IF EXISTS EdgeByPrimary;\n"
+	"CREATE INDEX IF NOT EXISTS ParamByParam ON Params ( Param );\n"
+	"CREATE INDEX IF NOT EXISTS EdgeByFile   ON Edges  ( File );\n", NULL },
+
+	// 2: optional chunked layout for files
+	{ "ALTER TABLE Files ADD COLUMN Chunked INTEGER NOT NULL DEFAULT 0;\n"
+	"CREATE TABLE FileChunks (\n"
+	"    File STRING NOT NULL,\n"
+	"    Seq  INTEGER NOT NULL,\n"
+	"    Data BLOB NOT NULL,\n"
+	"    PRIMARY KEY ( File, Seq )\n"
+	");\n", NULL },
+
+	// 3: content addressed storage, see stored_file_t
+	{ "ALTER TABLE Files RENAME TO OldFiles;\n"
+	"ALTER TABLE FileChunks RENAME TO OldChunks;\n"
+	"CREATE TABLE Blobs (\n"
+	"    Id      INTEGER PRIMARY KEY,\n"
+	"    Digest  BLOB UNIQUE,\n"
+	"    Size    INTEGER NOT NULL,\n"
+	"    Chunked INTEGER NOT NULL DEFAULT 0\n"
+	");\n"
+	"CREATE TABLE Contents (\n"
+	"    Blob    INTEGER PRIMARY KEY,\n"
+	"    Content BLOB NOT NULL\n"
+	");\n"
+	"CREATE TABLE Chunks (\n"
+	"    Blob INTEGER NOT NULL,\n"
+	"    Seq  INTEGER NOT NULL,\n"
+	"    Data BLOB NOT NULL,\n"
+	"    PRIMARY KEY ( Blob, Seq )\n"
+	");\n"
+	"CREATE TABLE Files (\n"
+	"    Name STRING NOT NULL,\n"
+	"    Blob INTEGER NOT NULL,\n"
+	"    PRIMARY KEY ( Name )\n"
+	");\n"
+	"CREATE INDEX FileByBlob ON Files ( Blob );\n", migrate_blobs },
+
+	// 4: connection settings, see load_settings()
+	{ "CREATE TABLE Settings (\n"
+	"    Name  STRING NOT NULL,\n"
+	"    Value INTEGER NOT NULL,\n"
+	"    PRIMARY KEY ( Name )\n"
+	");\n", NULL },
+
+	// 5: change tracking, every change to a config's params or attachments
+	// or to a file bumps the generation and stamps the name with it. The
+	// existing data becomes generation 1.
+	{ "CREATE TABLE Generation (\n"
+	"    Value INTEGER NOT NULL\n"
+	");\n"
+	"INSERT INTO Generation ( Value ) VALUES ( 1 );\n"
+	"CREATE TABLE ConfChanges (\n"
+	"    Name       STRING NOT NULL,\n"
+	"    Generation INTEGER NOT NULL,\n"
+	"    PRIMARY KEY ( Name )\n"
+	");\n"
+	"CREATE INDEX ConfChangeByGeneration ON ConfChanges ( Generation );\n"
+	"CREATE TABLE FileChanges (\n"
+	"    Name       STRING NOT NULL,\n"
+	"    Generation INTEGER NOT NULL,\n"
+	"    PRIMARY KEY ( Name )\n"
+	");\n"
+	"CREATE INDEX FileChangeByGeneration ON FileChanges ( Generation );\n"
+	"INSERT INTO ConfChanges ( Name, Generation ) SELECT Name, 1 FROM Params UNION SELECT Name, 1 FROM Edges;\n"
+	"INSERT INTO FileChanges ( Name, Generation ) SELECT Name, 1 FROM Files;\n"
+	"CREATE TRIGGER ParamInserted AFTER INSERT ON Params BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO ConfChanges ( Name, Generation ) SELECT NEW.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER ParamUpdated AFTER UPDATE ON Params BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO ConfChanges ( Name, Generation ) SELECT NEW.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER ParamDeleted AFTER DELETE ON Params BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO ConfChanges ( Name, Generation ) SELECT OLD.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER EdgeInserted AFTER INSERT ON Edges BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO ConfChanges ( Name, Generation ) SELECT NEW.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER EdgeUpdated AFTER UPDATE ON Edges BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO ConfChanges ( Name, Generation ) SELECT NEW.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER EdgeDeleted AFTER DELETE ON Edges BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO ConfChanges ( Name, Generation ) SELECT OLD.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER FileInserted AFTER INSERT ON Files BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO FileChanges ( Name, Generation ) SELECT NEW.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER FileUpdated AFTER UPDATE ON Files BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO FileChanges ( Name, Generation ) SELECT NEW.Name, Value FROM Generation;\n"
+	"END;\n"
+	"CREATE TRIGGER FileDeleted AFTER DELETE ON Files BEGIN\n"
+	"    UPDATE Generation SET Value = Value + 1;\n"
+	"    INSERT OR REPLACE INTO FileChanges ( Name, Generation ) SELECT OLD.Name, Value FROM Generation;\n"
+	"END;\n", NULL },
+
+	// 6: optional compression, see inflater_t. Size stays the size of the
+	// content, StoredSize is only set if the stored bytes differ from it.
+	{ "ALTER TABLE Blobs ADD COLUMN Codec INTEGER NOT NULL DEFAULT 0;\n"
+	"ALTER TABLE Blobs ADD COLUMN Dict INTEGER;\n"
+	"ALTER TABLE Blobs ADD COLUMN StoredSize INTEGER;\n"
+	"CREATE TABLE Dictionaries (\n"
+	"    Id      INTEGER PRIMARY KEY,\n"
+	"    Content BLOB NOT NULL\n"
+	");\n", NULL },
 
+	// 7: metadata for list-files, when a file was last stored and the type
+	// of its content, see sniff_type()
+	{ "ALTER TABLE Files ADD COLUMN StoredAt INTEGER;\n"
+	"ALTER TABLE Blobs ADD COLUMN Type STRING;\n", migrate_types },
+
+	// 8: the triggers only stamp changed names with the generation the
+	// running transaction will commit as, once per name. The generation
+	// itself is bumped once per transaction, see bump_generation().
+	{ STAMP_TRIGGER("ParamInserted", "INSERT", "Params", "NEW", "ConfChanges")
+	STAMP_TRIGGER("ParamUpdated",  "UPDATE", "Params", "NEW", "ConfChanges")
+	STAMP_TRIGGER("ParamDeleted",  "DELETE", "Params", "OLD", "ConfChanges")
+	STAMP_TRIGGER("EdgeInserted",  "INSERT", "Edges",  "NEW", "ConfChanges")
+	STAMP_TRIGGER("EdgeUpdated",   "UPDATE", "Edges",  "NEW", "ConfChanges")
+	STAMP_TRIGGER("EdgeDeleted",   "DELETE", "Edges",  "OLD", "ConfChanges")
+	STAMP_TRIGGER("FileInserted",  "INSERT", "Files",  "NEW", "FileChanges")
+	STAMP_TRIGGER("FileUpdated",   "UPDATE", "Files",  "NEW", "FileChanges")
+	STAMP_TRIGGER("FileDeleted",   "DELETE", "Files",  "OLD", "FileChanges"), NULL },
+
+	// 9: refreshing StoredAt of a file stored again with the same content
+	// doesn't change what export --since writes.
+	{ STAMP_TRIGGER("FileUpdated", "UPDATE OF Name, Blob", "Files", "NEW", "FileChanges"), NULL }
+};
+
+#define SCHEMA_VERSION ((int) (sizeof(migrations) / sizeof(migrations[0])))
+
+int schema_version(void) {
+	sqlite3_stmt *select_version = NULL;
+	int version;
+
+	if ( prepare("PRAGMA user_version;", &select_version) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_version);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(select_version) != SQLITE_ROW ) {
+		fprintf(stderr, "failed to read schema version : %s\n", sqlite3_errmsg(db));
+		release(select_version);
+		fail(EX_SOFTWARE);
+	}
+	version = sqlite3_column_int(select_version, 0);
+	release(select_version);
+
+	if ( version > SCHEMA_VERSION ) {
+		fprintf(stderr, "the database has schema version %i, this tool only knows up to version %i.\n", version, SCHEMA_VERSION);
+		fail(EX_DATAERR);
+	}
+	return version;
+}
+
+// Only touches the header page unless the database needs migrating.
 void init_db() {
-	char *err = NULL;
-	if ( sqlite3_exec(db, init_sql, NULL, NULL, &err) != SQLITE_OK ) {
-		fprintf(stderr, "failed to create schema : %s\n", sqlite3_errmsg(db));
-		exit(EX_SOFTWARE);
+	if ( schema_version() == SCHEMA_VERSION )
+		return;
+
+	if ( sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+
+	// Another process may have migrated the database in the meantime.
+	for ( int version = schema_version(); version < SCHEMA_VERSION; version++ ) {
+		char set_version[64];
+		snprintf(set_version, sizeof(set_version), "PRAGMA user_version = %i;", version + 1);
+
+		if ( sqlite3_exec(db, migrations[version].sql, NULL, NULL, NULL) != SQLITE_OK ) {
+			fprintf(stderr, "failed to migrate schema to version %i : %s\n", version + 1, sqlite3_errmsg(db));
+			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+			fail(EX_SOFTWARE);
+		}
+		if ( migrations[version].migrate != NULL )
+			migrations[version].migrate();
+		if ( sqlite3_exec(db, set_version, NULL, NULL, NULL) != SQLITE_OK ) {
+			fprintf(stderr, "failed to set schema version %i : %s\n", version + 1, sqlite3_errmsg(db));
+			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+			fail(EX_SOFTWARE);
+		}
+	}
+
+	if ( sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+		fail(EX_SOFTWARE);
 	}
 }
 
@@ -158,25 +847,25 @@ void show_conf(int argc, const char *argv[]) {
 	if ( argc != 4 )
 		usage(argv[0]);
 
-	if ( sqlite3_prepare_v2(db, "SELECT Param, Value FROM Params WHERE Name = ?;", -1, &select_name, NULL) != SQLITE_OK ) {
+	if ( prepare("SELECT Param, Value FROM Params WHERE Name = ?;", &select_name) != SQLITE_OK ) {
 		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_name);
-		exit(EX_SOFTWARE);
+		release(select_name);
+		fail(EX_SOFTWARE);
 	}
 		
 	if ( sqlite3_bind_text(select_name, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
 		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_name);
-		exit(EX_SOFTWARE);
+		release(select_name);
+		fail(EX_SOFTWARE);
 	}
 
 	while ( 1 ) {
-        	switch ( sqlite3_step(select_name) ) {
+        	switch ( step(select_name) ) {
 			case SQLITE_DONE:
-				sqlite3_finalize(select_name);
+				release(select_name);
 				if ( is_empty ) {
                                 	fprintf(stderr, "Their is no config named \"%s\".\n", argv[3]);
-					exit(1);
+					fail(1);
 				}
 				return;
 
@@ -186,194 +875,462 @@ void show_conf(int argc, const char *argv[]) {
 				is_empty = 0;
 				
 				if ( value != NULL && printf("%s %s\n", param, value) < 0 ) {
-					sqlite3_finalize(select_name);
+					release(select_name);
 					fputs("failed to write to standard output.\n", stderr);
-					exit(EX_IOERR);
+					fail(EX_IOERR);
 				}
 				if ( value == NULL && printf("%s\n", param) < 0 ) {
-					sqlite3_finalize(select_name);
+					release(select_name);
 					fputs("failed to write to standard output.\n", stderr);
-					exit(EX_IOERR);
+					fail(EX_IOERR);
 				}
 				break;
 			}
 
 			default:
 				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
-				sqlite3_finalize(select_name);
-				exit(EX_SOFTWARE);
+				release(select_name);
+				fail(EX_SOFTWARE);
 				break;
 		}
 	}
 }
 
-void read_conf(int argc, const char *argv[]) {
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	sqlite3_stmt *insert_param = NULL;
-	char *err = NULL;
+// Splits a config line in place into its param and value. Returns 0 for
+// comments and blank lines. value is NULL if the param has none.
+int parse_line(char *line, char **param, char **value) {
+	char *value_ = line, c;
+	if ( !strsep(&value_, "#;\n") ) return 0; // ignore comments and newlines
+	value_ = line;
+	strsep(&value_, " \t");
+	while (value_ && (c = *value_, c == ' ' || c == '\t')) value_++;
+	if ( strlen(line) == 0 ) return 0;
 
-	if ( argc != 4 ) {
-		usage(argv[0]);
-	}
+	*param = line;
+	*value = value_;
+	return 1;
+}
 
-	if ( sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO Params ( Name, Param, Value ) VALUES ( ?, ?, ? );", -1, &insert_param, NULL) != SQLITE_OK ) {
-		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_param);
-		exit(EX_SOFTWARE);
-	}
+// Returns the tag if the line opens an inline block like "<ca>", cutting
+// the line after it.
+char *block_start(char *line) {
+	line += strspn(line, " \t");
+	if ( line[0] != '<' || line[1] == '/' )
+		return NULL;
 
-	if ( sqlite3_bind_text(insert_param, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_param);
-		exit(EX_SOFTWARE);
-	}
-	
-	if ( sqlite3_exec(db, "BEGIN;", NULL, NULL, &err) != SQLITE_OK ) {
-		fprintf(stderr, "failed to begin commit : %s\n", sqlite3_errmsg(db));
-		exit(EX_SOFTWARE);
+	char *end = strchr(line, '>');
+	if ( end == NULL || end == line + 1 || end[1 + strspn(end + 1, " \t\r\n")] != '\0' )
+		return NULL;
+	*end = '\0';
+	return line + 1;
+}
+
+int is_block_end(const char *line, const char *tag) {
+	size_t len = strlen(tag);
+	line += strspn(line, " \t");
+	return line[0] == '<' && line[1] == '/' && strncmp(line + 2, tag, len) == 0 &&
+	       line[2 + len] == '>' && line[3 + len + strspn(line + 3 + len, " \t\r\n")] == '\0';
+}
+
+// Inserts one param through the prepared insert_param statement with the
+// config name already bound. The strings only need to live until it
+// returns, the statement is reset before.
+void store_param(sqlite3_stmt *insert_param, const char *param, const char *value) {
+	if ( sqlite3_bind_text(insert_param, 2, param, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
-	
-	while ( (linelen = getline(&line, &linecap, stdin)) > 0 ) {
-		char *value = line, c;
-		if ( !strsep(&value, "#;\n") ) continue; // ignore comments and newlines
-		value = line;
-		strsep(&value, " \t");
-		while (value && (c = *value, c == ' ' || c == '\t')) value++;
-		if ( strlen(line) == 0 ) continue;
-
-		if ( sqlite3_bind_text(insert_param, 2, line, -1, SQLITE_TRANSIENT) != SQLITE_OK ) {
-			fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(insert_param);
-			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-			exit(EX_SOFTWARE);
-		}
-		if ( value && sqlite3_bind_text(insert_param, 3, value, -1, SQLITE_TRANSIENT) != SQLITE_OK ) {
+	if ( value && sqlite3_bind_text(insert_param, 3, value, -1, SQLITE_STATIC) != SQLITE_OK ) {
                 	fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(insert_param);
-			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-			exit(EX_SOFTWARE);
-		}
-		if ( !value && sqlite3_bind_null(insert_param, 3) != SQLITE_OK ) {
-			fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(insert_param);
-			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-			exit(EX_SOFTWARE);
-		}
+		release(insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	if ( !value && sqlite3_bind_null(insert_param, 3) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
 
-		if ( sqlite3_step(insert_param) != SQLITE_DONE ) {
-			fprintf(stderr, "failed to insert into table : %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(insert_param);
-			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-			exit(EX_SOFTWARE);
-		}
+	if ( step(insert_param) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to insert into table : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
 
-		if ( sqlite3_reset(insert_param) != SQLITE_OK ) {
-			fprintf(stderr, "failed to reset insert statement : %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(insert_param);
-			sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-			exit(EX_SOFTWARE);
-		}
+	if ( sqlite3_reset(insert_param) != SQLITE_OK ) {
+		fprintf(stderr, "failed to reset insert statement : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
-	sqlite3_finalize(insert_param);
-	if ( line != NULL )
-		free(line);
+}
 
-	if ( ferror(stdin) ) {
-        	fprintf(stderr, "failed to read from stdin.\n");
-		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-		exit(EX_IOERR);
+void store_block(sqlite3_stmt *insert_param, const char *name, const char *tag, const uint8_t *body, size_t len, const uint8_t *digest);
+
+// Collects the lines of an inline block up to its closing tag.
+void load_block(sqlite3_stmt *insert_param, const char *name, const char *tag_, FILE *in) {
+	char *tag = strdup(tag_), *line = NULL, *body = NULL;
+	size_t linecap = 0, len = 0;
+	FILE *buf = open_memstream(&body, &len);
+	int closed = 0;
+
+	OWN(tag, free);
+	OWN(body, free);
+	OWN(buf, close_stream);
+	OWN(line, free);
+	if ( tag == NULL || buf == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	while ( getline(&line, &linecap, in) > 0 ) {
+		if ( (closed = is_block_end(line, tag)) )
+			break;
+		fputs(line, buf);
+	}
+	free(line);
+	fclose(buf);
+	disown(2);
+	if ( !closed ) {
+		fprintf(stderr, "the inline block <%s> isn't closed.\n", tag);
+		release(insert_param);
+		rollback();
+		fail(EX_DATAERR);
 	}
 
-	if ( sqlite3_exec(db, "COMMIT;", NULL, NULL, &err) != SQLITE_OK ) {
-		fprintf(stderr, "failed to commit transaction : %s\n", err);
-		sqlite3_finalize(insert_param);
-		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-		exit(EX_SOFTWARE);
+	store_block(insert_param, name, tag, (const uint8_t*) body, len, NULL);
+	free(body);
+	free(tag);
+	disown(2);
+}
+
+int cmp_names(sqlite3_stmt *a, int col_a, sqlite3_stmt *b, int col_b);
+int merge_step(sqlite3_stmt *stmt);
+sqlite3_int64 file_blob(const char *name);
+void gc_blob(sqlite3_int64 id);
+
+// Runs a statement binding the config name to ?1 and a text to ?2. Returns
+// the number of changed rows.
+int exec_param(sqlite3_stmt *stmt, const char *name, const char *text) {
+	if ( sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+	     sqlite3_bind_text(stmt, 2, text, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(stmt);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
+	if ( step(stmt) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to update table : %s\n", sqlite3_errmsg(db));
+		release(stmt);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	sqlite3_reset(stmt);
+	return sqlite3_changes(db);
 }
 
-const char *get_sql =
-	"SELECT ( SELECT COUNT(*) FROM Params WHERE Name = ?1 ),\n"
-        "       ( SELECT Value FROM Params WHERE Name = ?1 AND Param = ?2 );";
+int same_value(sqlite3_stmt *a, sqlite3_stmt *b, int col) {
+	const int type = sqlite3_column_type(a, col);
+	if ( type != sqlite3_column_type(b, col) )
+		return 0;
+	switch ( type ) {
+		case SQLITE_NULL:
+			return 1;
+		case SQLITE_INTEGER:
+			return sqlite3_column_int64(a, col) == sqlite3_column_int64(b, col);
+		case SQLITE_FLOAT:
+			return sqlite3_column_double(a, col) == sqlite3_column_double(b, col);
+		default: {
+			const void *x = sqlite3_column_blob(a, col), *y = sqlite3_column_blob(b, col);
+			const int len = sqlite3_column_bytes(a, col);
+			return len == sqlite3_column_bytes(b, col) && (len == 0 || memcmp(x, y, len) == 0);
+		}
+	}
+}
 
-void get_conf(int argc, const char *argv[]) {
-	sqlite3_stmt *select_param;
+// Writes the params collected in temp.Synced over the config's params. Both
+// sides are merged in the order of their primary keys, only params that
+// differ are inserted, updated or deleted. The edge to the inline file a
+// changed or removed param pointed at goes with it, and the file itself
+// once no config is attached to it anymore.
+void sync_conf(const char *name) {
+	sqlite3_stmt *select_synced = NULL, *select_params = NULL, *insert_param = NULL, *update_param = NULL,
+	             *delete_param = NULL, *delete_edge = NULL, *delete_orphan = NULL;
 
-	if ( argc != 5 )
-		usage(argv[0]);
-	
-	if ( sqlite3_prepare_v2(db, get_sql, -1, &select_param, NULL) != SQLITE_OK ) {
+	if ( prepare("SELECT Param, Value FROM temp.Synced WHERE Name = ?1 ORDER BY Param;", &select_synced) != SQLITE_OK ||
+	     prepare("SELECT Param, Value FROM Params WHERE Name = ?1 ORDER BY Param;", &select_params) != SQLITE_OK ||
+	     prepare("INSERT INTO Params ( Name, Param, Value ) VALUES ( ?1, ?2, ?3 );", &insert_param) != SQLITE_OK ||
+	     prepare("UPDATE Params SET Value = ?3 WHERE Name = ?1 AND Param = ?2;", &update_param) != SQLITE_OK ||
+	     prepare("DELETE FROM Params WHERE Name = ?1 AND Param = ?2;", &delete_param) != SQLITE_OK ||
+	     prepare("DELETE FROM Edges WHERE Name = ?1 AND File = ?2;", &delete_edge) != SQLITE_OK ||
+	     prepare("DELETE FROM Files WHERE Name = ?2 AND NOT EXISTS ( SELECT 1 FROM Edges WHERE File = ?2 );", &delete_orphan) != SQLITE_OK ) {
 		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_param);
-		exit(EX_SOFTWARE);
+		release(select_synced);
+		release(select_params);
+		release(insert_param);
+		release(update_param);
+		release(delete_param);
+		release(delete_edge);
+		release(delete_orphan);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
-        
-	if ( sqlite3_bind_text(select_param, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+	if ( sqlite3_bind_text(select_synced, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+	     sqlite3_bind_text(select_params, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
 		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_param);
-		exit(EX_SOFTWARE);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
 
-	if ( sqlite3_bind_text(select_param, 2, argv[4], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_param);
-		exit(EX_SOFTWARE);
+	int inserted = 0, updated = 0, deleted = 0, kept = 0, detached = 0, removed = 0;
+	int has_new = merge_step(select_synced), has_old = merge_step(select_params);
+	while ( has_new || has_old ) {
+		const int c = !has_new ? 1 : !has_old ? -1 : cmp_names(select_synced, 0, select_params, 0);
+		const int same = c == 0 && same_value(select_synced, select_params, 1);
+		if ( same ) {
+			kept++;
+		} else if ( c <= 0 ) {
+			sqlite3_stmt *write = c < 0 ? insert_param : update_param;
+			if ( sqlite3_bind_value(write, 3, sqlite3_column_value(select_synced, 1)) != SQLITE_OK ) {
+				fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+				rollback();
+				fail(EX_SOFTWARE);
+			}
+			exec_param(write, name, (const char*) sqlite3_column_text(select_synced, 0));
+			*(c < 0 ? &inserted : &updated) += 1;
+		} else {
+			exec_param(delete_param, name, (const char*) sqlite3_column_text(select_params, 0));
+			deleted++;
+		}
+		// The row of select_params stays valid until it is stepped, the
+		// writes above only touched rows at or before its position.
+		if ( c >= 0 && !same ) {
+			const char *old = (const char*) sqlite3_column_text(select_params, 1);
+			if ( old != NULL && strncmp(old, "inline/", 7) == 0 && exec_param(delete_edge, name, old) ) {
+				const sqlite3_int64 blob = file_blob(old);
+				detached++;
+				if ( exec_param(delete_orphan, name, old) ) {
+					gc_blob(blob);
+					removed++;
+				}
+			}
+		}
+		if ( c <= 0 )
+			has_new = merge_step(select_synced);
+		if ( c >= 0 )
+			has_old = merge_step(select_params);
 	}
+	release(select_synced);
+	release(select_params);
+	release(insert_param);
+	release(update_param);
+	release(delete_param);
+	release(delete_edge);
+	release(delete_orphan);
 
-	if ( sqlite3_step(select_param) != SQLITE_ROW ) {
-		fprintf(stderr, "logic error in get_conf().\n");
-		sqlite3_finalize(select_param);
-		exit(EX_SOFTWARE);
+	if ( printf("inserted %i, updated %i, deleted %i and kept %i params, detached %i and removed %i inline files.\n",
+	            inserted, updated, deleted, kept, detached, removed) < 0 ) {
+		fputs("failed to write to standard output.\n", stderr);
+		rollback();
+		fail(EX_IOERR);
 	}
+}
 
-	sqlite3_int64 count = sqlite3_column_int64(select_param, 0);
-	const unsigned char *value = sqlite3_column_text(select_param, 1);
+// Reads a config from in. With sync_params the params are collected in
+// temp.Synced first and only the differences written by sync_conf(), without
+// it every param is written and params missing from the input are kept.
+void load_conf(const char *name, FILE *in, int sync_params) {
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	sqlite3_stmt *insert_param = NULL;
 
-	if ( !count ) {
-		fprintf(stderr, "their is no config named \"%s\".\n", argv[3]);
-		sqlite3_finalize(select_param);
-		exit(1);
+	if ( sync_params && sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS Synced ( Name STRING NOT NULL, Param STRING NOT NULL, Value STRING, PRIMARY KEY ( Name, Param ) ); DELETE FROM temp.Synced;", NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to create the temporary table : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	if ( prepare(sync_params ? "INSERT OR REPLACE INTO temp.Synced ( Name, Param, Value ) VALUES ( ?, ?, ? );" :
+	                    "INSERT INTO Params ( Name, Param, Value ) VALUES ( ?, ?, ? )\n"
+	                    "ON CONFLICT ( Name, Param ) DO UPDATE SET Value = excluded.Value WHERE Value IS NOT excluded.Value;", &insert_param) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		fail(EX_SOFTWARE);
 	}
 
-	if ( !value ) {
-		fprintf(stderr, "their is parameter named \"%s\" in the config named \"%s\".\n", argv[4], argv[3]);
-		sqlite3_finalize(select_param);
-		exit(2);
+	if ( sqlite3_bind_text(insert_param, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		fail(EX_SOFTWARE);
+	}
+	
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin commit : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	
+	OWN(line, free);
+	while ( (linelen = getline(&line, &linecap, in)) > 0 ) {
+		char *param, *value, *tag;
+		if ( (tag = block_start(line)) != NULL )
+			load_block(insert_param, name, tag, in);
+		else if ( parse_line(line, &param, &value) )
+			store_param(insert_param, param, value);
 	}
+	release(insert_param);
+	free(line);
+	disown(1);
 
-	if ( puts((const char*)value) == EOF ) {
-		fprintf(stderr, "failed to write to stdout");
-		sqlite3_finalize(select_param);
-		exit(EX_IOERR);
+	if ( ferror(in) ) {
+        	fprintf(stderr, "failed to read config.\n");
+		rollback();
+		fail(EX_IOERR);
 	}
+	if ( sync_params )
+		sync_conf(name);
 
-	sqlite3_finalize(select_param);
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+		release(insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
 }
 
-void list_conf(int argc, const char *argv[]) {
-	sqlite3_stmt *select_conf = NULL;
+void read_conf(int argc, const char *argv[]) {
+	const int sync_params = argc == 5 && strcmp(argv[4], "--sync") == 0;
 
-	if ( argc != 3 )
+	if ( argc != 4 && !sync_params ) {
 		usage(argv[0]);
-	
-	if ( sqlite3_prepare_v2(db, "SELECT DISTINCT Name FROM Params ORDER BY Name ASC;", -1, &select_conf, NULL ) != SQLITE_OK ) {
-		fprintf(stderr, "failed to pepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_conf);
-		exit(EX_SOFTWARE);
 	}
 
-        while ( 1 ) {
-		switch ( sqlite3_step(select_conf) ) {
-                        case SQLITE_DONE:
-				sqlite3_finalize(select_conf);
-				return;
+	load_conf(argv[3], stdin, sync_params);
+}
+
+int cmp_param_ref(const void *a, const void *b) {
+	return strcmp(**(const char *const *const*) a, **(const char *const *const*) b);
+}
+
+// get <DB> <NAME> [--null] <PARAM>... looks all params up in one scan over
+// the config's primary key range, merged with the sorted request. A single
+// param prints just its value. Several print "PARAM VALUE" lines, or NUL
+// terminated params and values with --null, in the requested order. Exits
+// with 1 if there is no such config and with 2 if a param is missing, after
+// printing the ones found.
+void get_conf(int argc, const char *argv[]) {
+	sqlite3_stmt *select_params = NULL;
+	int nul = 0, first = 4;
+
+	if ( argc > 4 && strcmp(argv[4], "--null") == 0 ) {
+		nul = 1;
+		first = 5;
+	}
+	if ( argc <= first )
+		usage(argv[0]);
+
+	const char **params = argv + first;
+	const int n = argc - first;
+	const char **sorted[n];
+	char *values[n];
+	int present[n];
+	for ( int i = 0; i < n; i++ ) {
+		sorted[i] = &params[i];
+		values[i] = NULL;
+		present[i] = 0;
+	}
+	qsort(sorted, n, sizeof(*sorted), cmp_param_ref);
+
+	if ( prepare("SELECT Param, Value FROM Params WHERE Name = ? ORDER BY Param;", &select_params) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_params, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		fail(EX_SOFTWARE);
+	}
+
+	int is_empty = 1, j = 0, r;
+	while ( (r = step(select_params)) == SQLITE_ROW ) {
+		const char *param = (const char*) sqlite3_column_text(select_params, 0);
+		is_empty = 0;
+		while ( j < n && strcmp(*sorted[j], param) < 0 )
+			j++;
+		for ( int k = j; k < n && strcmp(*sorted[k], param) == 0; k++ ) {
+			int i = sorted[k] - params;
+			const unsigned char *value = sqlite3_column_text(select_params, 1);
+			present[i] = 1;
+			if ( value != NULL && (values[i] = strdup((const char*) value)) == NULL ) {
+				fputs("failed to allocate memory.\n", stderr);
+				fail(EX_OSERR);
+			}
+		}
+	}
+	if ( r != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		fail(EX_SOFTWARE);
+	}
+	release(select_params);
+
+	if ( is_empty ) {
+		fprintf(stderr, "their is no config named \"%s\".\n", argv[3]);
+		fail(1);
+	}
+
+	int status = 0;
+	for ( int i = 0; i < n; i++ ) {
+		int failed;
+		// A single param without a value has nothing to print.
+		if ( !present[i] || (n == 1 && values[i] == NULL) ) {
+			fprintf(stderr, "their is parameter named \"%s\" in the config named \"%s\".\n", params[i], argv[3]);
+			status = 2;
+			continue;
+		}
+		if ( n == 1 )
+			failed = printf(nul ? "%s%c" : "%s\n", values[i], '\0') < 0;
+		else if ( nul )
+			failed = printf("%s%c%s%c", params[i], '\0', values[i] ? values[i] : "", '\0') < 0;
+		else if ( values[i] != NULL )
+			failed = printf("%s %s\n", params[i], values[i]) < 0;
+		else
+			failed = printf("%s\n", params[i]) < 0;
+		free(values[i]);
+		if ( failed ) {
+			fprintf(stderr, "failed to write to stdout");
+			fail(EX_IOERR);
+		}
+	}
+	if ( status != 0 )
+		fail(status);
+}
+
+void list_conf(int argc, const char *argv[]) {
+	sqlite3_stmt *select_conf = NULL;
+
+	if ( argc != 3 )
+		usage(argv[0]);
+	
+	if ( prepare("SELECT DISTINCT Name FROM Params ORDER BY Name ASC;", &select_conf) != SQLITE_OK ) {
+		fprintf(stderr, "failed to pepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_conf);
+		fail(EX_SOFTWARE);
+	}
+
+        while ( 1 ) {
+		switch ( step(select_conf) ) {
+                        case SQLITE_DONE:
+				release(select_conf);
+				return;
 			
 			case SQLITE_ROW: {
 				const unsigned char *name = sqlite3_column_text(select_conf, 0);
 				if ( puts((const char*)name) == EOF ) {
-					sqlite3_finalize(select_conf);
+					release(select_conf);
 					fputs("failed to write to standard output.\n", stderr);
 				}
 				break;
@@ -381,559 +1338,4865 @@ void list_conf(int argc, const char *argv[]) {
 
 			default:
 				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
-				sqlite3_finalize(select_conf);
-				exit(EX_SOFTWARE);
+				release(select_conf);
+				fail(EX_SOFTWARE);
 				break;
 		}
 	}
 }
 
+// Descriptors may be non-blocking pipes. read_some() and write_all() wait
+// for them with poll() instead of retrying after a sleep.
+
+// Returns 0 once fd is ready for events or -1 with errno set.
+int wait_fd(int fd, short events) {
+	struct pollfd pfd = { .fd = fd, .events = events, .revents = 0 };
+	int r;
+
+	while ( (r = poll(&pfd, 1, -1)) < 0 && errno == EINTR )
+		;
+	return r < 0 ? -1 : 0;
+}
+
+// Reads at least one byte unless at EOF. Returns the number of bytes read,
+// 0 at EOF or -1 with errno set.
+ssize_t read_some(int fd, uint8_t *buf, size_t len) {
+	while ( 1 ) {
+		ssize_t n = read(fd, buf, len);
+		if ( n >= 0 )
+			return n;
+		if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+			if ( wait_fd(fd, POLLIN) )
+				return -1;
+		} else if ( errno != EINTR ) {
+			return -1;
+		}
+	}
+}
+
+// Reads until buf is full or fd hits EOF. Returns the number of bytes read
+// or -1 with errno set.
+ssize_t read_upto(int fd, uint8_t *buf, size_t len) {
+	size_t i = 0;
+
+	while ( i < len ) {
+		ssize_t n = read_some(fd, buf + i, len - i);
+		if ( n < 0 )
+			return -1;
+		if ( n == 0 )
+			break;
+		i += n;
+	}
+	return i;
+}
+
+// Returns 0 or -1 with errno set.
+int write_all(int fd, const uint8_t *buf, size_t len) {
+	while ( len > 0 ) {
+		ssize_t n = write(fd, buf, len);
+		if ( n >= 0 ) {
+			buf += n;
+			len -= n;
+		} else if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+			if ( wait_fd(fd, POLLOUT) )
+				return -1;
+		} else if ( errno != EINTR ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Reads input ahead on a thread into two buffers of size bytes each, so
+// the next buffer fills while the caller writes the last one into the
+// database or another descriptor. Buffers are filled completely except at
+// the end of the input. At most limit bytes are read unless it is negative.
+// The commands streaming input never run inside a batch, so failing while
+// the thread runs just ends the process.
+typedef struct prefetch {
+	int              fd;
+	size_t           size;
+	sqlite3_int64    limit;
+	uint8_t         *buf[2];
+	size_t           len[2];
+	int              ready[2];  // filled and not handed back yet
+	int              next;      // buffer prefetch_next() hands out next
+	int              current;   // buffer the caller holds, -1 for none
+	int              done;      // the thread filled its last buffer
+	int              error;     // errno of a failed read
+	int              stop;
+	double           started;
+	pthread_t        thread;
+	pthread_mutex_t  lock;
+	pthread_cond_t   cond;
+} prefetch_t;
+
+void *prefetch_worker(void *arg) {
+	prefetch_t *p = (prefetch_t*) arg;
+
+	for ( int i = 0; ; i ^= 1 ) {
+		pthread_mutex_lock(&p->lock);
+		while ( p->ready[i] && !p->stop )
+			pthread_cond_wait(&p->cond, &p->lock);
+		const int stop = p->stop;
+		pthread_mutex_unlock(&p->lock);
+		if ( stop )
+			break;
+
+		size_t want = p->size;
+		if ( p->limit >= 0 && (sqlite3_int64) want > p->limit )
+			want = (size_t) p->limit;
+		ssize_t n = read_upto(p->fd, p->buf[i], want);
+		const int error = n < 0 ? errno : 0;
+		if ( n > 0 && p->limit >= 0 )
+			p->limit -= n;
+
+		pthread_mutex_lock(&p->lock);
+		p->len[i] = n > 0 ? (size_t) n : 0;
+		p->ready[i] = 1;
+		p->error = error;
+		p->done = error != 0 || (size_t) n < want || p->limit == 0;
+		const int done = p->done;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		if ( done )
+			break;
+	}
+	return NULL;
+}
+
+void open_prefetch(prefetch_t *p, int fd, size_t size, sqlite3_int64 limit) {
+	memset(p, 0, sizeof(*p));
+	p->fd = fd;
+	p->size = size;
+	p->limit = limit;
+	p->current = -1;
+	p->started = now();
+	p->buf[0] = malloc(size);
+	p->buf[1] = malloc(size);
+	if ( p->buf[0] == NULL || p->buf[1] == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	if ( pthread_mutex_init(&p->lock, NULL) || pthread_cond_init(&p->cond, NULL) ||
+	     pthread_create(&p->thread, NULL, prefetch_worker, p) ) {
+		fputs("failed to start the read ahead thread.\n", stderr);
+		fail(EX_OSERR);
+	}
+}
+
+// Hands out the next buffer of input and takes back the one handed out
+// before. Returns its length, 0 at the end of the input or -1 with errno
+// set.
+ssize_t prefetch_next(prefetch_t *p, const uint8_t **buf) {
+	pthread_mutex_lock(&p->lock);
+	if ( p->current >= 0 ) {
+		p->ready[p->current] = 0;
+		p->current = -1;
+		pthread_cond_broadcast(&p->cond);
+	}
+	while ( !p->ready[p->next] && !p->done )
+		pthread_cond_wait(&p->cond, &p->lock);
+	if ( !p->ready[p->next] ) {
+		pthread_mutex_unlock(&p->lock);
+		return 0;
+	}
+	if ( p->error ) {
+		errno = p->error;
+		pthread_mutex_unlock(&p->lock);
+		return -1;
+	}
+	p->current = p->next;
+	p->next ^= 1;
+	*buf = p->buf[p->current];
+	const ssize_t n = (ssize_t) p->len[p->current];
+	stats.streamed += n;
+	pthread_mutex_unlock(&p->lock);
+	return n;
+}
+
+// Waits for the thread, which only blocks if the caller stops before the
+// end of the input.
+void close_prefetch(prefetch_t *p) {
+	const int error = errno;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->thread, NULL);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->cond);
+	free(p->buf[0]);
+	free(p->buf[1]);
+	stats.stream_time += now() - p->started;
+	errno = error;
+}
+
+#define STREAM_BUF_SIZE (128 * 1024)
+
 int copy_file(int src_fd, int dst_fd, uint64_t *len) {
-	int eof = 0;
+	prefetch_t p;
+	const uint8_t *buf;
 	uint64_t len_ = 0;
-	do {            
-		uint8_t buf[128*1024];
-		const struct timespec _10ms = { .tv_sec = 0, .tv_nsec = 10000000 };
-		size_t i = 0;
-		ssize_t delta;
-		do {
-			delta = read(src_fd, buf + i, sizeof(buf) - i);
-			if ( delta > 0 ) {
-                        	i += delta;
-			} else if ( delta == 0 ) {
-				eof = 1;
-			} else { 
-				switch ( errno ) {
-					case EAGAIN:
-						nanosleep(&_10ms, NULL);
-
-					case EINTR:
-						break;
-
-					default:
-						return 1;
-				}
-			}
-		} while ( !eof && i != sizeof(buf) );
+	ssize_t n;
 
-		size_t j = 0;
-		while ( j < i ) {
-			delta = write(dst_fd, buf + j, i - j);
-			if ( delta >= 0 ) {
-				j += delta;
-				len_ += delta;
-			} else {
-                                switch ( errno ) {
-					case EAGAIN:
-						nanosleep(&_10ms, NULL);
-					
-					case EINTR:
-						break;
-					
-					default:
-						return 2;
-				}
-			}
+	open_prefetch(&p, src_fd, STREAM_BUF_SIZE, -1);
+	while ( (n = prefetch_next(&p, &buf)) > 0 ) {
+		if ( write_all(dst_fd, buf, n) ) {
+			close_prefetch(&p);
+			return 2;
 		}
-	} while ( !eof );
+		len_ += n;
+		stats.copied += n;
+	}
+	close_prefetch(&p);
+	if ( n < 0 )
+		return 1;
 	if ( len ) *len = len_;
 
 	return 0;
 }
 
-void write_blob(sqlite3_blob *blob, int src_fd) {
-	int eof = 0;
+// Fills the whole blob from src_fd and feeds the data to hash. Running out
+// of input before the blob is full is an error.
+void write_blob(sqlite3_blob *blob, int src_fd, EVP_MD_CTX *hash) {
+	const int len = sqlite3_blob_bytes(blob);
+	prefetch_t p;
+	const uint8_t *buf;
 	int off = 0;
-	do {
-		uint8_t buf[128*1024];
-		const struct timespec _10ms = { .tv_sec = 0, .tv_nsec = 10000000 };
-		size_t i = 0;
-		ssize_t delta;
-
-		do {
-			delta = read(src_fd, buf + i, sizeof(buf) - i );
-			if ( delta > 0 ) {
-				i += delta;
-			} else if ( delta == 0 ) {
-				eof = 1;
-			} else {
-				switch ( errno ) {
-					case EAGAIN:
-						nanosleep(&_10ms, NULL);
-
-					case EINTR:
-						break;
-
-					default:
-                                                perror("failed to read from fd");
-						sqlite3_blob_close(blob);
-						exit(EX_IOERR);
-						break;
-				}
-			}
-		} while ( !eof && i != sizeof(buf) );
+	ssize_t n;
 
-		if ( sqlite3_blob_write(blob, buf, i, off) != SQLITE_OK ) {
+	open_prefetch(&p, src_fd, STREAM_BUF_SIZE, len);
+	while ( (n = prefetch_next(&p, &buf)) > 0 ) {
+		const double t = stats_clock();
+		if ( sqlite3_blob_write(blob, buf, (int) n, off) != SQLITE_OK ) {
 			fprintf(stderr, "failed to write to blob : %s\n", sqlite3_errmsg(db));
 			sqlite3_blob_close(blob);
-			exit(EX_IOERR);
+			fail(EX_IOERR);
 		}
+		stats.blob_io += stats_clock() - t;
+		stats.blob_written += n;
+		EVP_DigestUpdate(hash, buf, n);
+		off += n;
+	}
+	if ( n < 0 ) {
+		perror("failed to read from fd");
+		sqlite3_blob_close(blob);
+		fail(EX_IOERR);
+	}
+	close_prefetch(&p);
 
-		off += delta;
-	} while ( !eof );
+	if ( off < len ) {
+		fprintf(stderr, "input ended after %i of %i bytes.\n", off, len);
+		sqlite3_blob_close(blob);
+		fail(EX_DATAERR);
+	}
 }
 
-void store_file(int argc, const char *argv[]) {
-	if ( argc != 4 ) 
-		usage(argv[0]);
-	
+// Returns the length of the data left in src_fd if it is a regular file,
+// -1 otherwise.
+sqlite3_int64 remaining_len(int src_fd, off_t *pos) {
+	struct stat st;
+
+	if ( fstat(src_fd, &st) || !S_ISREG(st.st_mode) )
+		return -1;
+	if ( (*pos = lseek(src_fd, 0, SEEK_CUR)) == -1 )
+		return -1;
+	return st.st_size > *pos ? st.st_size - *pos : 0;
+}
+
+// Spools src_fd into an unlinked temporary file to learn its length. Only
+// needed for pipes of unknown length.
+int spool(int src_fd, sqlite3_int64 *len) {
 	const char *tmp_template = "/tmp/openvpn-db.XXXXXXXX";
 	char tmp_name[PATH_MAX];
 	strncpy(tmp_name, tmp_template, PATH_MAX);
 	int tmp_fd = mkstemp(tmp_name);
 	if ( tmp_fd == -1 ) {
 		perror("failed to create temporary file");
-		exit(EX_OSERR);
+		fail(EX_OSERR);
 	}
 	if ( unlink(tmp_name) ) {
 		perror("failed to unlink emporary file");
-		exit(EX_OSERR);
+		fail(EX_OSERR);
 	}
 	
-	uint64_t len;
-	if ( copy_file(STDIN_FILENO, tmp_fd, &len) ) {
+	uint64_t len_;
+	if ( copy_file(src_fd, tmp_fd, &len_) ) {
 		perror("failed to copy stdin to temporary file");
-		exit(EX_IOERR);
+		fail(EX_IOERR);
 	}
 
 	if ( lseek(tmp_fd, 0, SEEK_SET) == -1 ) {
         	perror("failed to rewind temporaray file");
-		exit(EX_IOERR);
+		fail(EX_IOERR);
 	}
-	
-	sqlite3_stmt *insert_file = NULL;
-	if ( sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO Files ( Name, Content ) VALUES ( ?, ? );", -1, &insert_file, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statment : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_file);
-		exit(EX_SOFTWARE);
+
+	*len = len_ > (uint64_t) INT64_MAX ? INT64_MAX : (sqlite3_int64) len_;
+	return tmp_fd;
+}
+
+// File contents are stored once per distinct SHA-256 digest. Files maps
+// names to Blobs, which hold digest, size and layout of the content. The
+// content itself is either a single Contents row or, if Chunked is set, a run
+// of Chunks rows of CHUNK_SIZE bytes each except the last one. Chunked
+// contents can exceed INT_MAX bytes and be written without knowing their
+// length. Digest is NULL only while a blob is being written.
+#define CHUNK_SIZE (1024*1024)
+#define DIGEST_LEN 32
+
+typedef struct stored_file {
+	const char    *name;
+	sqlite3_int64  id;
+	int            chunked;
+	sqlite3_int64  size;
+	int            codec;
+	sqlite3_int64  dict;
+} stored_file_t;
+
+typedef void (*sink_t)(void *ctx, const uint8_t *buf, size_t len);
+
+// Selects Id, Chunked, Size, Codec and Dict of the blob joined to a Files
+// row.
+#define FILE_COLUMNS_SQL "Blobs.Id, Blobs.Chunked, Blobs.Size, Blobs.Codec, Blobs.Dict"
+
+void column_file(sqlite3_stmt *stmt, int col, const char *name, stored_file_t *f) {
+	f->name    = name;
+	f->id      = sqlite3_column_int64(stmt, col);
+	f->chunked = sqlite3_column_int(stmt, col + 1);
+	f->size    = sqlite3_column_int64(stmt, col + 2);
+	f->codec   = sqlite3_column_int(stmt, col + 3);
+	f->dict    = sqlite3_column_int64(stmt, col + 4);
+}
+
+// Compressed blobs are always chunked and each Chunks row holds one zstd
+// frame of CHUNK_SIZE bytes of content, except the last one, so offsets
+// still map to rows. Frames are compressed with the dictionary Dict of the
+// blob, if any, see train_dict().
+#define CODEC_NONE 0
+#define CODEC_ZSTD 1
+#define COMPRESSION_LEVEL 9
+#define SELECT_DICT_SQL "SELECT Content FROM Dictionaries WHERE Id = ?;"
+
+typedef struct inflater {
+	ZSTD_DCtx     *dctx;
+	uint8_t       *buf;
+	sqlite3_int64  dict;    // loaded dictionary, 0 for none
+	sqlite3_int64  skip;    // content bytes to drop before the sink gets any
+	sqlite3_int64  left;    // content bytes the sink still takes
+	size_t         pending; // 0 once the frame is complete
+	int            last;    // last byte handed to the sink
+	sink_t         sink;
+	void          *ctx;
+} inflater_t;
+
+void free_inflater(inflater_t *z) {
+	ZSTD_freeDCtx(z->dctx);
+	free(z->buf);
+	z->dctx = NULL;
+	z->buf = NULL;
+	z->dict = 0;
+}
+
+// Prepares the inflater for the next frame, loading the dictionary through
+// select_dict if it differs from the last one. Returns 0 or an exit status
+// instead of failing, render workers use it on their own connections.
+int start_frame(inflater_t *z, sqlite3_stmt *select_dict, sqlite3_int64 dict) {
+	if ( z->dctx == NULL ) {
+		z->dctx = ZSTD_createDCtx();
+		z->buf = malloc(ZSTD_DStreamOutSize());
+		z->dict = 0;
+		if ( z->dctx == NULL || z->buf == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			return EX_OSERR;
+		}
 	}
-	if ( sqlite3_bind_text(insert_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_file);
-		exit(EX_SOFTWARE);
+	ZSTD_DCtx_reset(z->dctx, ZSTD_reset_session_only);
+	z->pending = 1;
+	if ( dict == z->dict )
+		return 0;
+
+	size_t r;
+	if ( dict == 0 ) {
+		r = ZSTD_DCtx_loadDictionary(z->dctx, NULL, 0);
+	} else {
+		if ( sqlite3_bind_int64(select_dict, 1, dict) != SQLITE_OK ) {
+			fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(sqlite3_db_handle(select_dict)));
+			return EX_SOFTWARE;
+		}
+		if ( step(select_dict) != SQLITE_ROW ) {
+			fprintf(stderr, "failed to select dictionary %lli : %s\n", dict, sqlite3_errmsg(sqlite3_db_handle(select_dict)));
+			sqlite3_reset(select_dict);
+			return EX_DATAERR;
+		}
+		r = ZSTD_DCtx_loadDictionary(z->dctx, sqlite3_column_blob(select_dict, 0), sqlite3_column_bytes(select_dict, 0));
+		sqlite3_reset(select_dict);
 	}
-	if ( !(len <= (uint64_t)INT_MAX) ) {
-		fprintf(stderr, "the SQLite 3 API doesn't support blobs larger than INT_MAX. Length of %" PRIu64 " is larger than %i.\n", len, INT_MAX);
-		sqlite3_finalize(insert_file);
-		exit(EX_SOFTWARE);
+	if ( ZSTD_isError(r) ) {
+		fprintf(stderr, "failed to load dictionary : %s\n", ZSTD_getErrorName(r));
+		return EX_SOFTWARE;
 	}
-	if ( sqlite3_bind_zeroblob(insert_file, 2, (int) len) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_file);
-		exit(EX_SOFTWARE);
+	z->dict = dict;
+	return 0;
+}
+
+// Feeds the next piece of a frame to the inflater and hands the content to
+// its sink. Returns 0 or an exit status. A row holds exactly one frame, so
+// bytes after its end are corrupt rather than the start of another frame.
+int inflate_frame(inflater_t *z, const uint8_t *data, size_t len) {
+	ZSTD_inBuffer in = { data, len, 0 };
+	int full;
+
+	if ( z->pending == 0 && len > 0 ) {
+		fputs("failed to decompress : data follows the end of the frame.\n", stderr);
+		return EX_DATAERR;
 	}
-	if ( sqlite3_step(insert_file) != SQLITE_DONE ) {
-		fprintf(stderr, "failed to insert into table : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_file);
-		exit(EX_SOFTWARE);
+	do {
+		ZSTD_outBuffer out = { z->buf, ZSTD_DStreamOutSize(), 0 };
+		z->pending = ZSTD_decompressStream(z->dctx, &out, &in);
+		if ( ZSTD_isError(z->pending) ) {
+			fprintf(stderr, "failed to decompress : %s\n", ZSTD_getErrorName(z->pending));
+			return EX_DATAERR;
+		}
+		full = out.pos == out.size;
+
+		const uint8_t *p = z->buf;
+		size_t n = out.pos;
+		if ( z->skip > 0 ) {
+			size_t k = (sqlite3_int64) n < z->skip ? n : (size_t) z->skip;
+			p += k;
+			n -= k;
+			z->skip -= k;
+		}
+		if ( (sqlite3_int64) n > z->left )
+			n = (size_t) z->left;
+		if ( n > 0 ) {
+			z->sink(z->ctx, p, n);
+			z->left -= n;
+			z->last = p[n - 1];
+		}
+	} while ( z->pending != 0 && (in.pos < in.size || full) );
+	if ( z->pending == 0 && in.pos < in.size ) {
+		fputs("failed to decompress : data follows the end of the frame.\n", stderr);
+		return EX_DATAERR;
 	}
-	sqlite3_finalize(insert_file);
-	
-	sqlite3_blob *blob = NULL;
-	sqlite3_int64 row_id = sqlite3_last_insert_rowid(db);
-	if ( sqlite3_blob_open(db, "main", "Files", "Content", row_id, 1, &blob) != SQLITE_OK ) {
-		fprintf(stderr, "failed to open blob for writing : %s\n", sqlite3_errmsg(db));
-		sqlite3_blob_close(blob);
-		exit(EX_SOFTWARE);
+	return 0;
+}
+
+void inflate_sink(void *ctx, const uint8_t *buf, size_t len) {
+	int status = inflate_frame((inflater_t*) ctx, buf, len);
+	if ( status != 0 )
+		fail(status);
+}
+
+EVP_MD_CTX *new_digest(void) {
+	EVP_MD_CTX *hash = EVP_MD_CTX_new();
+	if ( hash == NULL || EVP_DigestInit_ex(hash, EVP_sha256(), NULL) != 1 ) {
+		fputs("failed to initialize SHA-256.\n", stderr);
+		fail(EX_SOFTWARE);
 	}
-	
-	write_blob(blob, tmp_fd);
-	sqlite3_blob_close(blob);
+	return hash;
 }
 
-void read_blob(sqlite3_blob *blob, int dst_fd) {
-	int len = sqlite3_blob_bytes(blob);
-	int off = 0;
-	uint8_t buf[128*1024];
-	const struct timespec _10ms = { .tv_sec = 0, .tv_nsec = 10000000 };
+void finish_digest(EVP_MD_CTX *hash, uint8_t digest[DIGEST_LEN]) {
+	EVP_DigestFinal_ex(hash, digest, NULL);
+	EVP_MD_CTX_free(hash);
+}
 
-	while ( off < len ) {
-		int n = sizeof(buf) > len - off ? len - off : sizeof(buf);
-		if ( sqlite3_blob_read(blob, buf, n, off) != SQLITE_OK ) {
-			fprintf(stderr, "failed to read from blob : %s\n", sqlite3_errmsg(db));
-			sqlite3_blob_close(blob);
-			exit(EX_IOERR);
-		}
+void digest_sink(void *ctx, const uint8_t *buf, size_t len) {
+	EVP_DigestUpdate((EVP_MD_CTX*) ctx, buf, len);
+}
 
-		size_t j = 0;
-		while ( j < n ) {
-                	ssize_t delta = write(dst_fd, buf + j, n - j);
-			if ( delta >= 0 ) {
-				j += delta;
-			} else {
-				switch ( errno ) {
-					case EAGAIN:
-						nanosleep(&_10ms, NULL);
-
-					case EINTR:
-						break;
-					
-					default:
-						perror("failed to write to fd");
-						sqlite3_blob_close(blob);
-						exit(EX_IOERR);
-						break;
-				}
-			}
-		}
-		off += n;
+// Runs a statement without result rows binding up to two integer parameters.
+// Returns the number of changed rows.
+int exec_ids(const char *sql, sqlite3_int64 a, sqlite3_int64 b) {
+	sqlite3_stmt *stmt = NULL;
+	if ( prepare(sql, &stmt) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(stmt);
+		fail(EX_SOFTWARE);
 	}
+	const int params = sqlite3_bind_parameter_count(stmt);
+	if ( (params >= 1 && sqlite3_bind_int64(stmt, 1, a) != SQLITE_OK) ||
+	     (params >= 2 && sqlite3_bind_int64(stmt, 2, b) != SQLITE_OK) ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(stmt);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(stmt) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to execute statement : %s\n", sqlite3_errmsg(db));
+		release(stmt);
+		fail(EX_SOFTWARE);
+	}
+	release(stmt);
+	return sqlite3_changes(db);
 }
 
-void retrieve_file(int argc, const char *argv[]) {
-	if ( argc != 4 )
-		usage(argv[0]);
-	
-	sqlite3_stmt *select_file = NULL;
+// Names changed by a transaction are stamped with the current generation
+// plus one. Before the transaction commits the generation is bumped to
+// that value if it wrote any stamp, so export --since sees the changes of
+// a transaction under a single generation. Stamps of writers bypassing
+// this stay above the generation until the next bump and are exported
+// again rather than lost.
+void bump_generation(void) {
+	if ( sqlite3_total_changes(db) == txn_changes )
+		return;
 
-	if ( sqlite3_prepare_v2(db, "SELECT _rowid_ FROM Files WHERE Name = ?;", -1, &select_file, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_file);
-		exit(EX_SOFTWARE);
+	sqlite3_stmt *select_generation = NULL, *select_stamp = NULL;
+	if ( prepare("SELECT Value FROM Generation;", &select_generation) != SQLITE_OK ||
+	     prepare("SELECT 1 FROM ConfChanges WHERE Generation > ?1 UNION ALL SELECT 1 FROM FileChanges WHERE Generation > ?1 LIMIT 1;", &select_stamp) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_generation);
+		release(select_stamp);
+		fail(EX_SOFTWARE);
 	}
+	if ( step(select_generation) != SQLITE_ROW ) {
+		fprintf(stderr, "failed to read generation : %s\n", sqlite3_errmsg(db));
+		release(select_generation);
+		release(select_stamp);
+		fail(EX_SOFTWARE);
+	}
+	const sqlite3_int64 generation = sqlite3_column_int64(select_generation, 0);
+	release(select_generation);
+	if ( sqlite3_bind_int64(select_stamp, 1, generation) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_stamp);
+		fail(EX_SOFTWARE);
+	}
+	int r = step(select_stamp);
+	release(select_stamp);
+	if ( r == SQLITE_ROW )
+		exec_ids("UPDATE Generation SET Value = ?1;", generation + 1, 0);
+	else if ( r != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	txn_changes = sqlite3_total_changes(db);
+}
 
-	if ( sqlite3_bind_text(select_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_file);
-		exit(EX_SOFTWARE);
+// Returns the Id of the blob with the digest or 0 if there is none.
+sqlite3_int64 find_blob(const uint8_t digest[DIGEST_LEN]) {
+	sqlite3_stmt *select_blob = NULL;
+	if ( prepare("SELECT Id FROM Blobs WHERE Digest = ?;", &select_blob) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_blob);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_blob(select_blob, 1, digest, DIGEST_LEN, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_blob);
+		fail(EX_SOFTWARE);
 	}
 
-	sqlite3_int64 row_id = -1;
-	switch ( sqlite3_step(select_file) ) {
+	sqlite3_int64 id = 0;
+	switch ( step(select_blob) ) {
 		case SQLITE_ROW:
-			row_id = sqlite3_column_int64(select_file, 0);
+			id = sqlite3_column_int64(select_blob, 0);
 			break;
-		
+
 		case SQLITE_DONE:
-			fprintf(stderr, "Their is no file named \"%s\n store in the database.\n", argv[3]);
-			sqlite3_finalize(select_file);
-			exit(1);
 			break;
 
 		default:
-			fprintf(stderr, "failed to select file : %s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(select_file);
-			exit(EX_SOFTWARE);
+			fprintf(stderr, "failed to select blob : %s\n", sqlite3_errmsg(db));
+			release(select_blob);
+			fail(EX_SOFTWARE);
 			break;
 	}
-	sqlite3_finalize(select_file);
+	release(select_blob);
+	return id;
+}
 
-	sqlite3_blob *blob = NULL;
-	if ( sqlite3_blob_open(db, "main", "Files", "Content", row_id, 0, &blob) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to open blob for reading : %s\n", sqlite3_errmsg(db));
-		sqlite3_blob_close(blob);
-		exit(EX_SOFTWARE);
+sqlite3_int64 insert_blob(const uint8_t *digest, sqlite3_int64 size, int chunked) {
+	sqlite3_stmt *insert_blob = NULL;
+	if ( prepare("INSERT INTO Blobs ( Digest, Size, Chunked ) VALUES ( ?, ?, ? );", &insert_blob) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(insert_blob);
+		fail(EX_SOFTWARE);
 	}
-	
-	read_blob(blob, STDOUT_FILENO);
-	sqlite3_blob_close(blob);
+	if ( (digest != NULL ? sqlite3_bind_blob(insert_blob, 1, digest, DIGEST_LEN, SQLITE_STATIC) : sqlite3_bind_null(insert_blob, 1)) != SQLITE_OK ||
+	     sqlite3_bind_int64(insert_blob, 2, size) != SQLITE_OK ||
+	     sqlite3_bind_int(insert_blob, 3, chunked) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_blob);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(insert_blob) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to insert into table : %s\n", sqlite3_errmsg(db));
+		release(insert_blob);
+		fail(EX_SOFTWARE);
+	}
+	release(insert_blob);
+	return sqlite3_last_insert_rowid(db);
 }
 
-void ls(int argc, const char *argv[]) {
-	if ( argc != 3 )
-		usage(argv[0]);
-	
-	sqlite3_stmt *select_files = NULL;
-	if ( sqlite3_prepare_v2(db, "SELECT LENGTH(Content), Name FROM Files;", -1, &select_files, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_files);
-		exit(EX_SOFTWARE);
+// Inserts an all zero Contents row of size bytes to be filled through the
+// incremental blob API.
+void insert_content(sqlite3_int64 id, sqlite3_int64 size) {
+	sqlite3_stmt *insert_content = NULL;
+	if ( prepare("INSERT INTO Contents ( Blob, Content ) VALUES ( ?, ? );", &insert_content) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(insert_content);
+		fail(EX_SOFTWARE);
 	}
+	if ( sqlite3_bind_int64(insert_content, 1, id) != SQLITE_OK ||
+	     sqlite3_bind_zeroblob(insert_content, 2, (int) size) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_content);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(insert_content) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to insert into table : %s\n", sqlite3_errmsg(db));
+		release(insert_content);
+		fail(EX_SOFTWARE);
+	}
+	release(insert_content);
+}
 
-	int is_empty = 1;
-	while ( 1 ) {
-		switch ( sqlite3_step(select_files) ) {
-        		case SQLITE_DONE:
-				sqlite3_finalize(select_files);
-				if ( is_empty ) {
-					fprintf(stderr, "Their are no files stored in the database.\n");
-					exit(1);
-				}
-				return;
-			
-			case SQLITE_ROW: {
-				const int            len  = sqlite3_column_int(select_files, 0);
-				const unsigned char *name = sqlite3_column_text(select_files, 1);
-				is_empty = 0;
-
-                                if ( printf("%11i\t%s\n", len, name) < 0 ) {
-					sqlite3_finalize(select_files);
-					fputs("failed to write to standard output.\n", stderr);
-					exit(EX_IOERR);
-				}
-				break;
-			}
-
-			default:
-				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
-				sqlite3_finalize(select_files);
-				exit(EX_SOFTWARE);
-				break;
-		}
+void drop_blob(sqlite3_int64 id) {
+	exec_ids("DELETE FROM Blobs WHERE Id = ?;", id, 0);
+	exec_ids("DELETE FROM Contents WHERE Blob = ?;", id, 0);
+	exec_ids("DELETE FROM Chunks WHERE Blob = ?;", id, 0);
+}
 
+// Drops the blob once no file refers to it anymore.
+void gc_blob(sqlite3_int64 id) {
+	if ( exec_ids("DELETE FROM Blobs WHERE Id = ?1 AND NOT EXISTS ( SELECT 1 FROM Files WHERE Blob = ?1 );", id, 0) ) {
+		exec_ids("DELETE FROM Contents WHERE Blob = ?;", id, 0);
+		exec_ids("DELETE FROM Chunks WHERE Blob = ?;", id, 0);
 	}
 }
 
-void del(int argc, const char *argv[]) {
-	if ( argc != 4 )
-		usage(argv[0]);
+// Records the digest of a blob whose content was streamed in before the
+// digest was known. If the content is already stored, the new copy is
+// dropped again and the Id of the existing one returned.
+sqlite3_int64 dedup_blob(sqlite3_int64 id, const uint8_t digest[DIGEST_LEN], sqlite3_int64 size) {
+	sqlite3_int64 existing = find_blob(digest);
+	if ( existing != 0 ) {
+		drop_blob(id);
+		return existing;
+	}
 
-	if ( sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK ) {
-		fprintf(stderr, "failed to begin commit : %s\n", sqlite3_errmsg(db));
-		exit(EX_SOFTWARE);
+	sqlite3_stmt *update_blob = NULL;
+	if ( prepare("UPDATE Blobs SET Digest = ?, Size = ? WHERE Id = ?;", &update_blob) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(update_blob);
+		fail(EX_SOFTWARE);
 	}
-	
-	sqlite3_stmt *select_edge = NULL;
-	if ( sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM Edges WHERE File = ?;", -1, &select_edge, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		exit(EX_SOFTWARE);
+	if ( sqlite3_bind_blob(update_blob, 1, digest, DIGEST_LEN, SQLITE_STATIC) != SQLITE_OK ||
+	     sqlite3_bind_int64(update_blob, 2, size) != SQLITE_OK ||
+	     sqlite3_bind_int64(update_blob, 3, id) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(update_blob);
+		fail(EX_SOFTWARE);
 	}
-	if ( sqlite3_bind_text(select_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		exit(EX_SOFTWARE);
+	if ( step(update_blob) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to update blob : %s\n", sqlite3_errmsg(db));
+		release(update_blob);
+		fail(EX_SOFTWARE);
+	}
+	release(update_blob);
+	return id;
+}
+
+// Returns the blob the file name points at, 0 if there is no such file.
+sqlite3_int64 file_blob(const char *name) {
+	sqlite3_stmt *select_file = NULL;
+	if ( prepare("SELECT Blob FROM Files WHERE Name = ?;", &select_file) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_file);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_file, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_file);
+		fail(EX_SOFTWARE);
+	}
+	sqlite3_int64 old = 0;
+	switch ( step(select_file) ) {
+		case SQLITE_ROW:
+			old = sqlite3_column_int64(select_file, 0);
+			break;
+
+		case SQLITE_DONE:
+			break;
+
+		default:
+			fprintf(stderr, "failed to select file : %s\n", sqlite3_errmsg(db));
+			release(select_file);
+			fail(EX_SOFTWARE);
+			break;
+	}
+	release(select_file);
+	return old;
+}
+
+// Points the file name at the blob and drops the blob it replaced if that
+// one isn't used by other files.
+// Storing the same content again only refreshes StoredAt.
+void map_file(const char *name, sqlite3_int64 id) {
+	const sqlite3_int64 old = file_blob(name);
+
+	sqlite3_stmt *insert_file = NULL;
+	if ( prepare(old == id ?
+	             "UPDATE Files SET StoredAt = strftime('%s', 'now') WHERE Name = ?1 AND Blob = ?2;" :
+	             "INSERT OR REPLACE INTO Files ( Name, Blob, StoredAt ) VALUES ( ?1, ?2, strftime('%s', 'now') );", &insert_file) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statment : %s\n", sqlite3_errmsg(db));
+		release(insert_file);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(insert_file, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ||
+	     sqlite3_bind_int64(insert_file, 2, id) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_file);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(insert_file) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to insert into table : %s\n", sqlite3_errmsg(db));
+		release(insert_file);
+		fail(EX_SOFTWARE);
+	}
+	release(insert_file);
+
+	if ( old != 0 && old != id )
+		gc_blob(old);
+}
+
+// Content types are sniffed from the first TYPE_HEAD bytes. PEM files may
+// start with a text dump of the certificate, so the BEGIN line is searched.
+#define TYPE_HEAD 4096
+
+const char *sniff_type(const uint8_t *head, size_t len) {
+	const struct {
+		const char *label;
+		const char *type;
+	} labels[] = {
+		{ "CERTIFICATE REQUEST",  "csr" },
+		{ "TRUSTED CERTIFICATE",  "certificate" },
+		{ "CERTIFICATE",          "certificate" },
+		{ "X509 CRL",             "crl" },
+		{ "DH PARAMETERS",        "dh-params" },
+		{ "OpenVPN Static key",   "static-key" },
+		{ "OpenVPN tls-crypt-v2", "static-key" },
+		{ "PUBLIC KEY",           "public-key" },
+		{ "PRIVATE KEY",          "private-key" }
+	};
+	const char *begin = "-----BEGIN ";
+	const size_t begin_len = strlen(begin);
+	int text = 1;
+
+	if ( len == 0 )
+		return "empty";
+	for ( size_t i = 0; i < len; i++ ) {
+		if ( len - i > begin_len && memcmp(head + i, begin, begin_len) == 0 ) {
+			const char *label = (const char*) head + i + begin_len;
+			const size_t label_len = len - i - begin_len;
+			for ( size_t j = 0; j < sizeof(labels) / sizeof(*labels); j++ ) {
+				const size_t n = strlen(labels[j].label);
+				// Matches "RSA PRIVATE KEY" and "ENCRYPTED PRIVATE KEY" as well.
+				for ( size_t k = 0; k + n <= label_len && label[k] != '-' && label[k] != '\n'; k++ ) {
+					if ( memcmp(label + k, labels[j].label, n) == 0 )
+						return labels[j].type;
+				}
+			}
+			return "pem";
+		}
+		if ( head[i] < 0x20 && head[i] != '\t' && head[i] != '\n' && head[i] != '\r' )
+			text = 0;
+	}
+	return text ? "text" : "binary";
+}
+
+void set_type(sqlite3_int64 id, const uint8_t *head, size_t len) {
+	sqlite3_stmt *update_type = NULL;
+	if ( prepare("UPDATE Blobs SET Type = ? WHERE Id = ?;", &update_type) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(update_type);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(update_type, 1, sniff_type(head, len < TYPE_HEAD ? len : TYPE_HEAD), -1, SQLITE_STATIC) != SQLITE_OK ||
+	     sqlite3_bind_int64(update_type, 2, id) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(update_type);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(update_type) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to update blob : %s\n", sqlite3_errmsg(db));
+		release(update_type);
+		fail(EX_SOFTWARE);
+	}
+	release(update_type);
+}
+
+// Sniffs the type of content written through an open blob handle.
+void set_type_from_blob(sqlite3_int64 id, sqlite3_blob *blob) {
+	uint8_t head[TYPE_HEAD];
+	int n = sqlite3_blob_bytes(blob);
+
+	if ( n > TYPE_HEAD )
+		n = TYPE_HEAD;
+	if ( sqlite3_blob_read(blob, head, n, 0) != SQLITE_OK ) {
+		fprintf(stderr, "failed to read from blob : %s\n", sqlite3_errmsg(db));
+		sqlite3_blob_close(blob);
+		fail(EX_IOERR);
+	}
+	set_type(id, head, n);
+}
+
+// Parses a non-negative byte count from the command line.
+sqlite3_int64 parse_bytes(const char *arg, const char *name) {
+	char *end;
+	errno = 0;
+	long long n = strtoll(arg, &end, 10);
+	if ( *arg == '\0' || *end != '\0' || errno || n < 0 )
+		usage(name);
+	return n;
+}
+
+// Streams src_fd into Chunks one CHUNK_SIZE row at a time, so neither the
+// length has to be known up front nor more than two chunks held in memory,
+// the next one is read while the last one is stored. If size isn't negative
+// the input has to be exactly that long.
+void store_chunks(const char *name, int src_fd, sqlite3_int64 size, ZSTD_CCtx *cctx, sqlite3_int64 dict) {
+	const size_t frame_cap = ZSTD_compressBound(CHUNK_SIZE);
+	uint8_t *frame = cctx != NULL ? malloc(frame_cap) : NULL;
+	if ( cctx != NULL && frame == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_int64 id = insert_blob(NULL, 0, 1);
+	sqlite3_stmt *insert_chunk = NULL;
+	if ( prepare("INSERT INTO Chunks ( Blob, Seq, Data ) VALUES ( ?, ?, ? );", &insert_chunk) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statment : %s\n", sqlite3_errmsg(db));
+		release(insert_chunk);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_int64(insert_chunk, 1, id) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(insert_chunk);
+		fail(EX_SOFTWARE);
+	}
+
+	EVP_MD_CTX *hash = new_digest();
+	sqlite3_int64 len = 0, stored = 0;
+	uint8_t head[TYPE_HEAD];
+	size_t head_len = 0;
+	prefetch_t input;
+	const uint8_t *buf;
+	ssize_t n;
+	open_prefetch(&input, src_fd, CHUNK_SIZE, -1);
+	for ( sqlite3_int64 seq = 0; (n = prefetch_next(&input, &buf)) > 0; seq++ ) {
+		const uint8_t *data = buf;
+		size_t data_len = n;
+		if ( cctx != NULL ) {
+			data = frame;
+			data_len = ZSTD_compress2(cctx, frame, frame_cap, buf, n);
+			if ( ZSTD_isError(data_len) ) {
+				fprintf(stderr, "failed to compress : %s\n", ZSTD_getErrorName(data_len));
+				release(insert_chunk);
+				fail(EX_SOFTWARE);
+			}
+		}
+		stored += data_len;
+		if ( sqlite3_bind_int64(insert_chunk, 2, seq) != SQLITE_OK ||
+		     sqlite3_bind_blob(insert_chunk, 3, data, (int) data_len, SQLITE_STATIC) != SQLITE_OK ) {
+			fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+			release(insert_chunk);
+			fail(EX_SOFTWARE);
+		}
+		if ( step(insert_chunk) != SQLITE_DONE ) {
+			fprintf(stderr, "failed to insert chunk : %s\n", sqlite3_errmsg(db));
+			release(insert_chunk);
+			fail(EX_SOFTWARE);
+		}
+		sqlite3_reset(insert_chunk);
+		EVP_DigestUpdate(hash, buf, n);
+		if ( seq == 0 )
+			memcpy(head, buf, head_len = (size_t) n < sizeof(head) ? (size_t) n : sizeof(head));
+		len += n;
+	}
+	if ( n < 0 ) {
+		perror("failed to read from fd");
+		release(insert_chunk);
+		fail(EX_IOERR);
+	}
+	close_prefetch(&input);
+	release(insert_chunk);
+	free(frame);
+
+	if ( size >= 0 && len != size ) {
+		fprintf(stderr, "expected %lli bytes of input, got %lli.\n", size, len);
+		rollback();
+		fail(EX_DATAERR);
+	}
+	set_type(id, head, head_len);
+	if ( cctx != NULL ) {
+		sqlite3_stmt *update_blob = NULL;
+		if ( prepare("UPDATE Blobs SET Codec = ?1, Dict = nullif(?2, 0), StoredSize = ?3 WHERE Id = ?4;", &update_blob) != SQLITE_OK ) {
+			fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+			release(update_blob);
+			fail(EX_SOFTWARE);
+		}
+		if ( sqlite3_bind_int(update_blob, 1, CODEC_ZSTD) != SQLITE_OK ||
+		     sqlite3_bind_int64(update_blob, 2, dict) != SQLITE_OK ||
+		     sqlite3_bind_int64(update_blob, 3, stored) != SQLITE_OK ||
+		     sqlite3_bind_int64(update_blob, 4, id) != SQLITE_OK ) {
+			fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+			release(update_blob);
+			fail(EX_SOFTWARE);
+		}
+		if ( step(update_blob) != SQLITE_DONE ) {
+			fprintf(stderr, "failed to update blob : %s\n", sqlite3_errmsg(db));
+			release(update_blob);
+			fail(EX_SOFTWARE);
+		}
+		release(update_blob);
+	}
+
+	uint8_t digest[DIGEST_LEN];
+	finish_digest(hash, digest);
+	map_file(name, dedup_blob(id, digest, len));
+
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+}
+
+// Stores already hashed content unless a blob with the same digest exists
+// and returns the id of the blob holding it.
+sqlite3_int64 store_content(const uint8_t *data, sqlite3_int64 len, const uint8_t digest[DIGEST_LEN]) {
+	sqlite3_int64 id = find_blob(digest);
+	if ( id != 0 )
+		return id;
+
+	id = insert_blob(digest, len, 0);
+	insert_content(id, len);
+	set_type(id, data, len);
+	if ( len == 0 )
+		return id;
+
+	sqlite3_blob *blob = NULL;
+	if ( sqlite3_blob_open(db, "main", "Contents", "Content", id, 1, &blob) != SQLITE_OK ) {
+		fprintf(stderr, "failed to open blob for writing : %s\n", sqlite3_errmsg(db));
+		sqlite3_blob_close(blob);
+		fail(EX_SOFTWARE);
+	}
+	const double t = stats_clock();
+	if ( sqlite3_blob_write(blob, data, (int) len, 0) != SQLITE_OK ) {
+		fprintf(stderr, "failed to write to blob : %s\n", sqlite3_errmsg(db));
+		sqlite3_blob_close(blob);
+		fail(EX_IOERR);
+	}
+	sqlite3_blob_close(blob);
+	stats.blob_io += stats_clock() - t;
+	stats.blob_written += len;
+	return id;
+}
+
+void insert_edge(const char *name, const char *file) {
+	sqlite3_stmt *insert_edge = NULL;
+	// Ignoring an existing edge keeps the triggers from bumping the
+	// generation for nothing.
+	if ( prepare("INSERT OR IGNORE INTO Edges ( Name, File ) VALUES ( ?, ? );", &insert_edge) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(insert_edge);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(insert_edge, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(insert_edge);
+		fail(EX_SOFTWARE);
+	}
+        if ( sqlite3_bind_text(insert_edge, 2, file, -1, SQLITE_STATIC) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(insert_edge);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( step(insert_edge) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to insert edge : %s\n", sqlite3_errmsg(db));
+		release(insert_edge);
+		fail(EX_SOFTWARE);
+	}
+	release(insert_edge);
+}
+
+// Stores the body of an inline <tag> block as the file inline/TAG-DIGEST,
+// so identical blocks of different configs share one file, attaches it and
+// points the tag param at it. The body is hashed unless digest is given.
+void store_block(sqlite3_stmt *insert_param, const char *name, const char *tag, const uint8_t *body, size_t len, const uint8_t *digest) {
+	char file[sizeof("inline/") + 64 + 2 * DIGEST_LEN];
+	uint8_t own_digest[DIGEST_LEN];
+
+	if ( strlen(tag) > 64 ) {
+		fprintf(stderr, "the inline block <%s> has a too long tag.\n", tag);
+		release(insert_param);
+		rollback();
+		fail(EX_DATAERR);
+	}
+	if ( digest == NULL ) {
+		if ( EVP_Digest(len > 0 ? body : (const uint8_t*) "", len, own_digest, NULL, EVP_sha256(), NULL) != 1 ) {
+			fputs("failed to hash the inline block.\n", stderr);
+			fail(EX_SOFTWARE);
+		}
+		digest = own_digest;
+	}
+	int n = snprintf(file, sizeof(file), "inline/%s-", tag);
+	for ( int i = 0; i < DIGEST_LEN; i++ )
+		n += snprintf(file + n, sizeof(file) - n, "%02x", digest[i]);
+
+	map_file(file, store_content(body, len, digest));
+	insert_edge(name, file);
+	store_param(insert_param, tag, file);
+}
+
+// Returns a compression context using the newest dictionary, if one was
+// trained, and stores the dictionary's Id in dict.
+ZSTD_CCtx *new_compressor(sqlite3_int64 *dict) {
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	if ( cctx == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, COMPRESSION_LEVEL);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+
+	sqlite3_stmt *select_dict = NULL;
+	if ( prepare("SELECT Id, Content FROM Dictionaries ORDER BY Id DESC LIMIT 1;", &select_dict) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_dict);
+		fail(EX_SOFTWARE);
+	}
+	*dict = 0;
+	switch ( step(select_dict) ) {
+		case SQLITE_ROW: {
+			size_t r = ZSTD_CCtx_loadDictionary(cctx, sqlite3_column_blob(select_dict, 1), sqlite3_column_bytes(select_dict, 1));
+			if ( ZSTD_isError(r) ) {
+				fprintf(stderr, "failed to load dictionary : %s\n", ZSTD_getErrorName(r));
+				release(select_dict);
+				fail(EX_SOFTWARE);
+			}
+			*dict = sqlite3_column_int64(select_dict, 0);
+			break;
+		}
+
+		case SQLITE_DONE:
+			break;
+
+		default:
+			fprintf(stderr, "failed to select dictionary : %s\n", sqlite3_errmsg(db));
+			release(select_dict);
+			fail(EX_SOFTWARE);
+			break;
+	}
+	release(select_dict);
+	return cctx;
+}
+
+// Regular files on stdin are mapped, hashed and, unless the content is
+// already stored, written into the blob in one go. Pipes of unknown length
+// are spooled first and then handled the same way. Input of known length
+// (--size) is streamed straight into the blob and hashed on the way, so a
+// duplicate is only detected, and dropped again, after it was written.
+// Compressed input is always streamed into chunks. Content already stored
+// keeps the codec it was stored with.
+void store_file(int argc, const char *argv[]) {
+	sqlite3_int64 size = -1;
+	int chunked = 0, compress = 0;
+
+	if ( argc < 4 )
+		usage(argv[0]);
+	for ( int i = 4; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--size") == 0 && i + 1 < argc )
+			size = parse_bytes(argv[++i], argv[0]);
+		else if ( strcmp(argv[i], "--chunked") == 0 )
+			chunked = 1;
+		else if ( strcmp(argv[i], "--compress") == 0 )
+			compress = 1;
+		else
+			usage(argv[0]);
+	}
+
+	if ( compress ) {
+		sqlite3_int64 dict;
+		ZSTD_CCtx *cctx = new_compressor(&dict);
+		store_chunks(argv[3], STDIN_FILENO, size, cctx, dict);
+		ZSTD_freeCCtx(cctx);
+		return;
+	}
+
+	int src_fd = STDIN_FILENO;
+	off_t pos = 0;
+	sqlite3_int64 len = size;
+	if ( len < 0 )
+		len = remaining_len(src_fd, &pos);
+	if ( len < 0 && !chunked )
+		src_fd = spool(STDIN_FILENO, &len);
+
+	// Blobs are limited to INT_MAX bytes, larger input is always chunked.
+	if ( chunked || len > INT_MAX ) {
+		store_chunks(argv[3], src_fd, size, NULL, 0);
+		if ( src_fd != STDIN_FILENO )
+			close(src_fd);
+		return;
+	}
+
+	uint8_t *map = NULL;
+	if ( size < 0 && len > 0 ) {
+		map = mmap(NULL, pos + len, PROT_READ, MAP_SHARED, src_fd, 0);
+		if ( map == MAP_FAILED )
+			map = NULL;
+		else
+			posix_madvise(map, pos + len, POSIX_MADV_SEQUENTIAL);
+	}
+
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+
+	uint8_t digest[DIGEST_LEN];
+	sqlite3_int64 id;
+	if ( size < 0 && (map != NULL || len == 0) ) {
+		if ( EVP_Digest(map != NULL ? map + pos : (const uint8_t*) "", len, digest, NULL, EVP_sha256(), NULL) != 1 ) {
+			fputs("failed to hash the file.\n", stderr);
+			fail(EX_SOFTWARE);
+		}
+		id = store_content(map != NULL ? map + pos : NULL, len, digest);
+	} else {
+		id = insert_blob(NULL, len, 0);
+		insert_content(id, len);
+
+		sqlite3_blob *blob = NULL;
+		if ( sqlite3_blob_open(db, "main", "Contents", "Content", id, 1, &blob) != SQLITE_OK ) {
+			fprintf(stderr, "failed to open blob for writing : %s\n", sqlite3_errmsg(db));
+			sqlite3_blob_close(blob);
+			fail(EX_SOFTWARE);
+		}
+		EVP_MD_CTX *hash = new_digest();
+		write_blob(blob, src_fd, hash);
+		set_type_from_blob(id, blob);
+		sqlite3_blob_close(blob);
+		finish_digest(hash, digest);
+
+		// A --size shorter than the input would silently truncate the file.
+		uint8_t extra;
+		if ( size >= 0 && read_some(STDIN_FILENO, &extra, 1) > 0 ) {
+			fprintf(stderr, "the input is longer than %lli bytes.\n", len);
+			rollback();
+			fail(EX_DATAERR);
+		}
+
+		id = dedup_blob(id, digest, len);
+	}
+	if ( map != NULL )
+		munmap(map, pos + len);
+	if ( src_fd != STDIN_FILENO )
+		close(src_fd);
+
+	map_file(argv[3], id);
+
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+}
+
+void open_row(sqlite3_blob **blob, const char *table, const char *column, sqlite3_int64 row_id);
+
+// Trains a zstd dictionary on the uncompressed contents, first the unchunked
+// ones, which are the small certificates, keys and configs it pays off for,
+// then the first chunk of every chunked one, and stores it for put-file
+// --compress. Samples are read through blob handles cut to SAMPLE_SIZE
+// bytes and the corpus to SAMPLES_SIZE bytes, so large blobs are never
+// loaded whole. Blobs keep the dictionary they were compressed with, so
+// older dictionaries stay.
+#define SAMPLE_SIZE  (128 * 1024)
+#define SAMPLES_SIZE (128 * 1024 * 1024)
+#define SELECT_SAMPLES_SQL \
+	"SELECT 0, Contents._rowid_ FROM Contents JOIN Blobs ON Blobs.Id = Contents.Blob AND Blobs.Codec = 0\n" \
+	"UNION ALL\n" \
+	"SELECT 1, Chunks._rowid_ FROM Blobs CROSS JOIN Chunks ON Chunks.Blob = Blobs.Id AND Chunks.Seq = 0 AND Blobs.Chunked AND Blobs.Codec = 0;"
+
+void train_dict(int argc, const char *argv[]) {
+	size_t dict_size = 112640, n = 0, samples_len = 0, sizes_cap = 0;
+	size_t *sizes = NULL;
+	uint8_t *samples = NULL;
+
+	if ( argc == 5 && strcmp(argv[3], "--size") == 0 )
+		dict_size = (size_t) parse_bytes(argv[4], argv[0]);
+	else if ( argc != 3 )
+		usage(argv[0]);
+
+	sqlite3_stmt *select_samples = NULL;
+	if ( prepare(SELECT_SAMPLES_SQL, &select_samples) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_samples);
+		fail(EX_SOFTWARE);
+	}
+	if ( (samples = malloc(SAMPLES_SIZE)) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+
+	sqlite3_blob *blobs[2] = { NULL, NULL }; // contents and chunks
+	int rc;
+	while ( samples_len < SAMPLES_SIZE && (rc = step(select_samples)) == SQLITE_ROW ) {
+		const int chunk = sqlite3_column_int(select_samples, 0);
+		open_row(&blobs[chunk], chunk ? "Chunks" : "Contents", chunk ? "Data" : "Content", sqlite3_column_int64(select_samples, 1));
+		size_t len = sqlite3_blob_bytes(blobs[chunk]);
+		if ( len == 0 )
+			continue;
+		if ( len > SAMPLE_SIZE )
+			len = SAMPLE_SIZE;
+		if ( len > SAMPLES_SIZE - samples_len )
+			len = SAMPLES_SIZE - samples_len;
+		if ( n == sizes_cap && (sizes = realloc(sizes, (sizes_cap = sizes_cap ? sizes_cap * 2 : 1024) * sizeof(size_t))) == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			fail(EX_OSERR);
+		}
+		const double t = stats_clock();
+		if ( sqlite3_blob_read(blobs[chunk], samples + samples_len, (int) len, 0) != SQLITE_OK ) {
+			fprintf(stderr, "failed to read from blob : %s\n", sqlite3_errmsg(db));
+			release(select_samples);
+			fail(EX_SOFTWARE);
+		}
+		stats.blob_io += stats_clock() - t;
+		stats.blob_read += len;
+		samples_len += len;
+		sizes[n++] = len;
+	}
+	sqlite3_blob_close(blobs[0]);
+	sqlite3_blob_close(blobs[1]);
+	if ( samples_len < SAMPLES_SIZE && rc != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		release(select_samples);
+		fail(EX_SOFTWARE);
+	}
+	release(select_samples);
+
+	uint8_t *dict = malloc(dict_size);
+	if ( dict == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	size_t r = ZDICT_trainFromBuffer(dict, dict_size, samples, sizes, (unsigned) n);
+	free(samples);
+	free(sizes);
+	if ( ZDICT_isError(r) ) {
+		fprintf(stderr, "failed to train dictionary on %zu files : %s\n", n, ZDICT_getErrorName(r));
+		free(dict);
+		fail(EX_DATAERR);
+	}
+
+	sqlite3_stmt *insert_dict = NULL;
+	if ( prepare("INSERT INTO Dictionaries ( Content ) VALUES ( ? );", &insert_dict) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(insert_dict);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_blob(insert_dict, 1, dict, (int) r, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(insert_dict);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(insert_dict) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to insert dictionary : %s\n", sqlite3_errmsg(db));
+		release(insert_dict);
+		fail(EX_SOFTWARE);
+	}
+	release(insert_dict);
+	free(dict);
+	printf("%lli\t%zu\t%zu\n", sqlite3_last_insert_rowid(db), r, n);
+}
+
+// Blob handles are moved from row to row with sqlite3_blob_reopen() instead
+// of being reopened for every file or chunk.
+typedef struct file_reader {
+	sqlite3_blob *content;
+	sqlite3_blob *chunk;
+	inflater_t    inflater;
+} file_reader_t;
+
+void close_reader(file_reader_t *r) {
+	sqlite3_blob_close(r->content);
+	sqlite3_blob_close(r->chunk);
+	r->content = r->chunk = NULL;
+	free_inflater(&r->inflater);
+}
+
+void open_row(sqlite3_blob **blob, const char *table, const char *column, sqlite3_int64 row_id) {
+	if ( (*blob == NULL ? sqlite3_blob_open(db, "main", table, column, row_id, 0, blob) : sqlite3_blob_reopen(*blob, row_id)) != SQLITE_OK ) {
+		fprintf(stderr, "failed to open blob for reading : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+}
+
+// Hands len bytes of the blob starting at off to the sink in 128 KiB pieces.
+void read_blob(sqlite3_blob *blob, int off, int len, sink_t sink, void *ctx) {
+	uint8_t buf[128*1024];
+
+	while ( len > 0 ) {
+		int n = sizeof(buf) > len ? len : sizeof(buf);
+		const double t = stats_clock();
+		if ( sqlite3_blob_read(blob, buf, n, off) != SQLITE_OK ) {
+			fprintf(stderr, "failed to read from blob : %s\n", sqlite3_errmsg(db));
+			fail(EX_IOERR);
+		}
+		stats.blob_io += stats_clock() - t;
+		stats.blob_read += n;
+		sink(ctx, buf, n);
+		off += n;
+		len -= n;
+	}
+}
+
+// Decompresses the frame of the chunk row r->chunk points at, drops the
+// first skip bytes of it and hands at most len bytes of the rest to the
+// sink. Returns the number of bytes handed on.
+sqlite3_int64 inflate_chunk(file_reader_t *r, const stored_file_t *f, int skip, sqlite3_int64 len, sink_t sink, void *ctx) {
+	inflater_t *z = &r->inflater;
+	sqlite3_stmt *select_dict = NULL;
+
+	if ( f->dict != z->dict && prepare(SELECT_DICT_SQL, &select_dict) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_dict);
+		fail(EX_SOFTWARE);
+	}
+	int status = start_frame(z, select_dict, f->dict);
+	release(select_dict);
+	if ( status != 0 )
+		fail(status);
+
+	z->skip = skip;
+	z->left = len;
+	z->sink = sink;
+	z->ctx = ctx;
+	read_blob(r->chunk, 0, sqlite3_blob_bytes(r->chunk), inflate_sink, z);
+	if ( z->pending != 0 ) {
+		fprintf(stderr, "a chunk of the file named \"%s\" is truncated.\n", f->name);
+		fail(EX_DATAERR);
+	}
+	return len - z->left;
+}
+
+// Streams len bytes of the stored file starting at off to the sink.
+void read_file(file_reader_t *r, const stored_file_t *f, sqlite3_int64 off, sqlite3_int64 len, sink_t sink, void *ctx) {
+	if ( off >= f->size )
+		return;
+	if ( len < 0 || len > f->size - off )
+		len = f->size - off;
+
+	if ( !f->chunked ) {
+		open_row(&r->content, "Contents", "Content", f->id);
+		read_blob(r->content, (int) off, (int) len, sink, ctx);
+		return;
+	}
+
+	sqlite3_stmt *select_chunks = NULL;
+	if ( prepare("SELECT _rowid_ FROM Chunks WHERE Blob = ? AND Seq >= ? ORDER BY Seq;", &select_chunks) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_chunks);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_int64(select_chunks, 1, f->id) != SQLITE_OK ||
+	     sqlite3_bind_int64(select_chunks, 2, off / CHUNK_SIZE) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_chunks);
+		fail(EX_SOFTWARE);
+	}
+
+	int chunk_off = off % CHUNK_SIZE;
+	while ( len > 0 ) {
+		switch ( step(select_chunks) ) {
+			case SQLITE_ROW: {
+				open_row(&r->chunk, "Chunks", "Data", sqlite3_column_int64(select_chunks, 0));
+				if ( f->codec != CODEC_NONE ) {
+					len -= inflate_chunk(r, f, chunk_off, len, sink, ctx);
+					chunk_off = 0;
+					break;
+				}
+				int n = sqlite3_blob_bytes(r->chunk) - chunk_off;
+				if ( n > len )
+					n = len;
+				read_blob(r->chunk, chunk_off, n, sink, ctx);
+				chunk_off = 0;
+				len -= n;
+				break;
+			}
+
+			case SQLITE_DONE:
+				fprintf(stderr, "the chunks of the file named \"%s\" are incomplete.\n", f->name);
+				release(select_chunks);
+				fail(EX_DATAERR);
+				break;
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_chunks);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+	release(select_chunks);
+}
+
+void fd_sink(void *ctx, const uint8_t *buf, size_t n) {
+	const double t = stats_clock();
+	if ( write_all(*(const int*) ctx, buf, n) ) {
+		perror("failed to write to fd");
+		fail(EX_IOERR);
+	}
+	stats.output += stats_clock() - t;
+}
+
+// Collects the pieces read from blobs into few large writes.
+#define OUT_BUF_SIZE (1024 * 1024)
+
+typedef struct out_file {
+	int      fd;
+	uint8_t *buf;
+	size_t   used;
+} out_file_t;
+
+// get-file --out writes into a temporary file next to the target and
+// renames it over the target once the content is synced, so readers never
+// see a partial file. The temporary file, its descriptor and buffer are
+// released by discard_out() if the command fails.
+char      *pending_out  = NULL;
+out_file_t pending_file = { .fd = -1, .buf = NULL, .used = 0 };
+
+void discard_out(void) {
+	if ( pending_file.fd >= 0 )
+		close(pending_file.fd);
+	free(pending_file.buf);
+	pending_file = (out_file_t) { .fd = -1, .buf = NULL, .used = 0 };
+	if ( pending_out == NULL )
+		return;
+	unlink(pending_out);
+	free(pending_out);
+	pending_out = NULL;
+}
+
+void out_sink(void *ctx, const uint8_t *buf, size_t n) {
+	out_file_t *out = ctx;
+
+	if ( out->used + n > OUT_BUF_SIZE ) {
+		fd_sink(&out->fd, out->buf, out->used);
+		out->used = 0;
+	}
+	if ( n >= OUT_BUF_SIZE ) {
+		fd_sink(&out->fd, buf, n);
+		return;
+	}
+	memcpy(out->buf + out->used, buf, n);
+	out->used += n;
+}
+
+// Returns pending_file. The rename would replace a symlink at the target
+// rather than the file it points to, so a symlink is refused.
+out_file_t *open_out(const char *path) {
+	static int registered = 0;
+	struct stat st;
+
+	if ( !registered ) {
+		atexit(discard_out);
+		registered = 1;
+	}
+	discard_out();
+	const int exists = lstat(path, &st) == 0;
+	if ( exists && S_ISLNK(st.st_mode) ) {
+		fprintf(stderr, "refusing to replace the symlink %s.\n", path);
+		fail(EX_CANTCREAT);
+	}
+	if ( (pending_file.buf = malloc(OUT_BUF_SIZE)) == NULL || (pending_out = malloc(strlen(path) + 8)) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		discard_out();
+		fail(EX_OSERR);
+	}
+	sprintf(pending_out, "%s.XXXXXX", path);
+
+	if ( (pending_file.fd = mkstemp(pending_out)) < 0 ) {
+		fprintf(stderr, "failed to create temporary file for %s : %s\n", path, strerror(errno));
+		free(pending_out);
+		pending_out = NULL;
+		discard_out();
+		fail(EX_CANTCREAT);
+	}
+	// Replacing a file keeps its mode, new files stay private (0600).
+	if ( exists && S_ISREG(st.st_mode) )
+		fchmod(pending_file.fd, st.st_mode & 07777);
+	return &pending_file;
+}
+
+void finish_out(out_file_t *out, const char *path) {
+	fd_sink(&out->fd, out->buf, out->used);
+	out->used = 0;
+	const int synced = fsync(out->fd) == 0;
+	const int closed = close(out->fd) == 0;
+	out->fd = -1;
+	if ( !synced || !closed ) {
+		fprintf(stderr, "failed to write %s : %s\n", path, strerror(errno));
+		fail(EX_IOERR);
+	}
+	if ( rename(pending_out, path) != 0 ) {
+		fprintf(stderr, "failed to rename %s to %s : %s\n", pending_out, path, strerror(errno));
+		fail(EX_CANTCREAT);
+	}
+	free(pending_out);
+	pending_out = NULL;
+	discard_out();
+
+	// Makes the rename itself durable.
+	const char *slash = strrchr(path, '/');
+	char *dir = slash == NULL ? strdup(".") : slash == path ? strdup("/") : strndup(path, slash - path);
+	int dir_fd = dir != NULL ? open(dir, O_RDONLY) : -1;
+	if ( dir_fd >= 0 ) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	free(dir);
+}
+
+// Moves the files of schema version 2, renamed to OldFiles and OldChunks,
+// into content addressed blobs. Contents are copied inside SQLite, only
+// hashing them goes through this process.
+void migrate_blobs(void) {
+	sqlite3_stmt *select_old = NULL;
+	if ( prepare("SELECT _rowid_, Name, Chunked FROM OldFiles;", &select_old) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_old);
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_stmt *select_chunks = NULL;
+	if ( prepare("SELECT _rowid_ FROM OldChunks WHERE File = ? ORDER BY Seq;", &select_chunks) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_old);
+		release(select_chunks);
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_blob *content = NULL, *chunk = NULL;
+	int row;
+	while ( (row = step(select_old)) == SQLITE_ROW ) {
+		const sqlite3_int64  old     = sqlite3_column_int64(select_old, 0);
+		const char          *name    = (const char*) sqlite3_column_text(select_old, 1);
+		const int            chunked = sqlite3_column_int(select_old, 2);
+		EVP_MD_CTX *hash = new_digest();
+		sqlite3_int64 size = 0;
+
+		if ( !chunked ) {
+			open_row(&content, "OldFiles", "Content", old);
+			size = sqlite3_blob_bytes(content);
+			read_blob(content, 0, (int) size, digest_sink, hash);
+		} else {
+			if ( sqlite3_bind_text(select_chunks, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+				fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+				fail(EX_SOFTWARE);
+			}
+			while ( (row = step(select_chunks)) == SQLITE_ROW ) {
+				open_row(&chunk, "OldChunks", "Data", sqlite3_column_int64(select_chunks, 0));
+				read_blob(chunk, 0, sqlite3_blob_bytes(chunk), digest_sink, hash);
+				size += sqlite3_blob_bytes(chunk);
+			}
+			if ( row != SQLITE_DONE ) {
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				fail(EX_SOFTWARE);
+			}
+			sqlite3_reset(select_chunks);
+		}
+
+		uint8_t digest[DIGEST_LEN];
+		finish_digest(hash, digest);
+		sqlite3_int64 id = find_blob(digest);
+		if ( id == 0 ) {
+			id = insert_blob(digest, size, chunked);
+			if ( !chunked )
+				exec_ids("INSERT INTO Contents ( Blob, Content ) SELECT ?1, Content FROM OldFiles WHERE _rowid_ = ?2;", id, old);
+			else
+				exec_ids("INSERT INTO Chunks ( Blob, Seq, Data ) SELECT ?1, Seq, Data FROM OldChunks WHERE File = ( SELECT Name FROM OldFiles WHERE _rowid_ = ?2 );", id, old);
+		}
+		// Not map_file(), Files has no StoredAt column yet at this version.
+		exec_ids("INSERT OR REPLACE INTO Files ( Name, Blob ) SELECT Name, ?1 FROM OldFiles WHERE _rowid_ = ?2;", id, old);
+	}
+	if ( row != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	sqlite3_blob_close(content);
+	sqlite3_blob_close(chunk);
+	release(select_old);
+	release(select_chunks);
+
+	if ( sqlite3_exec(db, "DROP TABLE OldFiles; DROP TABLE OldChunks;", NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to drop the old file tables : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+}
+
+typedef struct head {
+	uint8_t buf[TYPE_HEAD];
+	size_t  len;
+} head_t;
+
+void head_sink(void *ctx, const uint8_t *buf, size_t n) {
+	head_t *head = ctx;
+
+	if ( n > sizeof(head->buf) - head->len )
+		n = sizeof(head->buf) - head->len;
+	memcpy(head->buf + head->len, buf, n);
+	head->len += n;
+}
+
+// Sniffs the type of every blob stored before version 7.
+void migrate_types(void) {
+	sqlite3_stmt *select_blobs = NULL;
+	if ( prepare("SELECT " FILE_COLUMNS_SQL " FROM Blobs;", &select_blobs) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_blobs);
+		fail(EX_SOFTWARE);
+	}
+
+	file_reader_t reader = { NULL, NULL };
+	int row;
+	while ( (row = step(select_blobs)) == SQLITE_ROW ) {
+		stored_file_t blob;
+		head_t head = { .len = 0 };
+		column_file(select_blobs, 0, "", &blob);
+		read_file(&reader, &blob, 0, TYPE_HEAD, head_sink, &head);
+		set_type(blob.id, head.buf, head.len);
+	}
+	if ( row != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	close_reader(&reader);
+	release(select_blobs);
+}
+
+void retrieve_file(int argc, const char *argv[]) {
+	sqlite3_int64 off = 0, len = -1;
+	const char *out_path = NULL;
+
+	if ( argc < 4 )
+		usage(argv[0]);
+	for ( int i = 4; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--offset") == 0 && i + 1 < argc )
+			off = parse_bytes(argv[++i], argv[0]);
+		else if ( strcmp(argv[i], "--length") == 0 && i + 1 < argc )
+			len = parse_bytes(argv[++i], argv[0]);
+		else if ( strcmp(argv[i], "--out") == 0 && i + 1 < argc )
+			out_path = argv[++i];
+		else
+			usage(argv[0]);
+	}
+	
+	sqlite3_stmt *select_file = NULL;
+
+	if ( prepare("SELECT " FILE_COLUMNS_SQL " FROM Files JOIN Blobs ON Blobs.Id = Files.Blob WHERE Files.Name = ?;", &select_file) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_file);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( sqlite3_bind_text(select_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_file);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		release(select_file);
+		fail(EX_SOFTWARE);
+	}
+
+	stored_file_t file;
+	switch ( step(select_file) ) {
+		case SQLITE_ROW:
+			column_file(select_file, 0, argv[3], &file);
+			break;
+		
+		case SQLITE_DONE:
+			fprintf(stderr, "Their is no file named \"%s\" stored in the database.\n", argv[3]);
+			release(select_file);
+			fail(1);
+			break;
+
+		default:
+			fprintf(stderr, "failed to select file : %s\n", sqlite3_errmsg(db));
+			release(select_file);
+			fail(EX_SOFTWARE);
+			break;
+	}
+	release(select_file);
+
+	file_reader_t reader = { NULL, NULL };
+	if ( out_path == NULL ) {
+		int dst_fd = STDOUT_FILENO;
+		read_file(&reader, &file, off, len, fd_sink, &dst_fd);
+		close_reader(&reader);
+		commit();
+		return;
+	}
+
+	out_file_t *out = open_out(out_path);
+	read_file(&reader, &file, off, len, out_sink, out);
+	close_reader(&reader);
+	commit();
+	finish_out(out, out_path);
+}
+
+// Lists files in name order from Files and Blobs alone, neither of which
+// holds content, by a range over the primary key of Files. The range starts
+// at the prefix or after the name of the last file of the previous page,
+// whichever is larger, so a page costs the same wherever it starts.
+#define LIST_FILES_SQL \
+	"SELECT Blobs.Size, coalesce(Blobs.StoredSize, Blobs.Size), lower(hex(Blobs.Digest)), " \
+	"strftime('%Y-%m-%dT%H:%M:%SZ', Files.StoredAt, 'unixepoch'), Blobs.Type, Files.Name " \
+	"FROM Files JOIN Blobs ON Blobs.Id = Files.Blob "
+
+// Names have NUMERIC affinity, a numeric name is stored as a number and sorts
+// before every text name, which are the names >= ''. A prefix matches text
+// names as a range and numbers by their text, ?3 skips the names up to
+// --after. Indexed by [prefix][after].
+#define LIST_NUMBERS_SQL(after) \
+	LIST_FILES_SQL "WHERE Files.Name < '' AND substr(Files.Name, 1, length(?1)) = ?1" after "\nUNION ALL\n"
+#define LIST_TEXTS_SQL(after) \
+	LIST_FILES_SQL "WHERE Files.Name >= '' AND Files.Name >= ?1 AND Files.Name < ?2" after " ORDER BY 6 LIMIT ?4;"
+
+const char *const list_files_sql[2][2] = {
+	{ LIST_FILES_SQL "ORDER BY Files.Name LIMIT ?4;",
+	  LIST_FILES_SQL "WHERE Files.Name > ?3 ORDER BY Files.Name LIMIT ?4;" },
+	{ LIST_NUMBERS_SQL("") LIST_TEXTS_SQL(""),
+	  LIST_NUMBERS_SQL(" AND Files.Name > ?3") LIST_TEXTS_SQL(" AND Files.Name > ?3") }
+};
+
+void ls(int argc, const char *argv[]) {
+	const char *prefix = "", *after = NULL;
+	sqlite3_int64 limit = -1;
+
+	if ( argc < 3 )
+		usage(argv[0]);
+	for ( int i = 3; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--prefix") == 0 && i + 1 < argc )
+			prefix = argv[++i];
+		else if ( strcmp(argv[i], "--limit") == 0 && i + 1 < argc )
+			limit = parse_bytes(argv[++i], argv[0]);
+		else if ( strcmp(argv[i], "--after") == 0 && i + 1 < argc )
+			after = argv[++i];
+		else
+			usage(argv[0]);
+	}
+
+	// Names are UTF-8, which never contains 0xff, so every name starting
+	// with the prefix sorts below the prefix followed by 0xff.
+	char *end = NULL;
+	if ( *prefix != '\0' ) {
+		const size_t n = strlen(prefix);
+		if ( (end = malloc(n + 2)) == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			fail(EX_OSERR);
+		}
+		memcpy(end, prefix, n);
+		end[n] = '\xff';
+		end[n + 1] = '\0';
+	}
+
+	sqlite3_stmt *select_files = NULL;
+	if ( prepare(list_files_sql[end != NULL][after != NULL], &select_files) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_files);
+		free(end);
+		fail(EX_SOFTWARE);
+	}
+	if ( (end != NULL && (sqlite3_bind_text(select_files, 1, prefix, -1, SQLITE_STATIC) != SQLITE_OK ||
+	                      sqlite3_bind_text(select_files, 2, end, -1, SQLITE_STATIC) != SQLITE_OK)) ||
+	     (after != NULL && sqlite3_bind_text(select_files, 3, after, -1, SQLITE_STATIC) != SQLITE_OK) ||
+	     sqlite3_bind_int64(select_files, 4, limit) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_files);
+		free(end);
+		fail(EX_SOFTWARE);
+	}
+
+	int is_empty = 1;
+	while ( 1 ) {
+		switch ( step(select_files) ) {
+        		case SQLITE_DONE:
+				release(select_files);
+				free(end);
+				if ( is_empty ) {
+					if ( *prefix == '\0' && after == NULL )
+						fprintf(stderr, "Their are no files stored in the database.\n");
+					fail(1);
+				}
+				return;
+			
+			case SQLITE_ROW: {
+				const sqlite3_int64  len       = sqlite3_column_int64(select_files, 0);
+				const sqlite3_int64  stored    = sqlite3_column_int64(select_files, 1);
+				const unsigned char *digest    = sqlite3_column_text(select_files, 2);
+				const unsigned char *stored_at = sqlite3_column_text(select_files, 3);
+				const unsigned char *type      = sqlite3_column_text(select_files, 4);
+				const unsigned char *name      = sqlite3_column_text(select_files, 5);
+				is_empty = 0;
+
+                                if ( printf("%11lli\t%11lli\t%s\t%-20s\t%-11s\t%s\n", len, stored, digest,
+				            stored_at != NULL ? (const char*) stored_at : "-",
+				            type != NULL ? (const char*) type : "-", name) < 0 ) {
+					release(select_files);
+					free(end);
+					fputs("failed to write to standard output.\n", stderr);
+					fail(EX_IOERR);
+				}
+				break;
+			}
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_files);
+				free(end);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}
+
+void del(int argc, const char *argv[]) {
+	if ( argc != 4 )
+		usage(argv[0]);
+
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin commit : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	
+	sqlite3_stmt *select_edge = NULL;
+	if ( prepare("SELECT COUNT(*) FROM Edges WHERE File = ?;", &select_edge) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_stmt *delete_file = NULL;
+	if ( prepare("DELETE FROM Files WHERE Name = ?;", &delete_file) != SQLITE_OK ) {
+		fprintf(stderr, "failed to perpare statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		release(delete_file);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( sqlite3_bind_text(delete_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		release(delete_file);
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_stmt *count_file = NULL;
+	if ( prepare("SELECT Blob FROM Files WHERE Name = ?;", &count_file) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		release(delete_file);
+		release(count_file);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(count_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		release(delete_file);
+		release(count_file);
+		fail(EX_SOFTWARE);
+	}
+	
+	int count = 0;
+	if ( step(select_edge) == SQLITE_ROW ) {
+		count = sqlite3_column_int(select_edge, 0);
+	} else {
+                fprintf(stderr, "failed to count the edges attached to this file : %s\n", sqlite3_errmsg(db));
+                release(select_edge);
+		release(delete_file);
+		release(count_file);
+		fail(EX_SOFTWARE);
+	}
+        release(select_edge);
+	if ( count != 0 ) {
+		fprintf(stderr, "The file named \"%s\" is attached to configs.\n", argv[3]);
+		release(delete_file);
+		release(count_file);
+		fail(1);
+	}
+
+	sqlite3_int64 blob = 0;
+	int present = 0;
+	switch ( step(count_file) ) {
+		case SQLITE_ROW:
+			blob = sqlite3_column_int64(count_file, 0);
+			present = 1;
+			break;
+
+		case SQLITE_DONE:
+			break;
+
+		default:
+			fprintf(stderr, "failed to count file : %s\n", sqlite3_errmsg(db));
+			release(delete_file);
+			release(count_file);
+			fail(EX_SOFTWARE);
+			break;
+	}
+	release(count_file);
+	if ( !present ) {
+        	fprintf(stderr, "Their is no file named \"%s\" to delete.\n", argv[3]);
+		release(delete_file);
+		fail(2);
+	}
+
+	if ( step(delete_file) != SQLITE_DONE ) {
+        	fprintf(stderr, "failed to delete the file named \"%s\" : %s\n", argv[3], sqlite3_errmsg(db));
+		release(delete_file);
+		fail(EX_SOFTWARE);
+	}
+	release(delete_file);
+	gc_blob(blob);
+
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+}
+
+void add_edge(int argc, const char *argv[]) {
+	if ( argc != 5 )
+		usage(argv[0]);
+
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	insert_edge(argv[3], argv[4]);
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+}
+
+void del_edge(int argc, const char *argv[]) {
+	if ( argc != 5 )
+		usage(argv[0]);
+	
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_stmt *delete_edge = NULL;
+	if ( prepare("DELETE FROM Edges WHERE Name = ? AND File = ?;", &delete_edge) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(delete_edge);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(delete_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(delete_edge);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(delete_edge, 2, argv[4], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(delete_edge);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( step(delete_edge) != SQLITE_DONE ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(delete_edge);
+		fail(EX_SOFTWARE);
+	}
+	release(delete_edge);
+
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+}
+
+void list_edges(int argc, const char *argv[]) {
+	if ( argc != 4 )
+		usage(argv[0]);
+
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	
+	sqlite3_stmt *select_edge = NULL;
+	if ( prepare("SELECT File FROM Edges WHERE Name = ?;", &select_edge) != SQLITE_OK ) {
+        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_edge);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	
+	int is_empty = 1;
+	while ( 1 ) {
+		switch ( step(select_edge) ) {
+			case SQLITE_DONE:
+				release(select_edge);
+				commit();
+				if ( is_empty ) {
+					fprintf(stderr, "Their is no file attached to the config named \"%s\".\n", argv[3]);
+					fail(1);
+				}
+				return;
+			
+			case SQLITE_ROW: {
+				const unsigned char *file = sqlite3_column_text(select_edge, 0);
+				is_empty = 0;
+
+                                if ( printf("%s\n", file) < 0 ) {
+					release(select_edge);
+					fputs("failed to write to standard output.\n", stderr);
+					fail(EX_IOERR);
+				}
+				break;
+			}
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_edge);
+				rollback();
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}                                            
+
+// Prints the count selected by a count(*) statement.
+void print_count(sqlite3_stmt *count) {
+	if ( step(count) != SQLITE_ROW ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		release(count);
+		fail(EX_SOFTWARE);
+	}
+	if ( printf("%lli\n", sqlite3_column_int64(count, 0)) < 0 ) {
+		release(count);
+		fputs("failed to write to standard output.\n", stderr);
+		fail(EX_IOERR);
+	}
+	release(count);
+}
+
+// Finds the configs setting a param, optionally to a value or to one
+// matching a LIKE pattern. Every variant is a range over ParamByParam, rows
+// are printed in index order as they are found instead of being sorted.
+#define FIND_SQL(columns, filter) "SELECT " columns " FROM Params WHERE Param = ?1" filter ";"
+
+void find_params(int argc, const char *argv[]) {
+	const char *const find_sql[2][3] = {
+		{ FIND_SQL("Name, Value", ""), FIND_SQL("Name, Value", " AND Value = ?2"), FIND_SQL("Name, Value", " AND Value LIKE ?2") },
+		{ FIND_SQL("count(*)", ""),    FIND_SQL("count(*)", " AND Value = ?2"),    FIND_SQL("count(*)", " AND Value LIKE ?2") }
+	};
+	const char *param = NULL, *value = NULL;
+	int count = 0, filter = 0;
+
+	for ( int i = 3; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--count") == 0 ) {
+			count = 1;
+		} else if ( strcmp(argv[i], "--like") == 0 && i + 1 < argc && param != NULL && filter == 0 ) {
+			value = argv[++i];
+			filter = 2;
+		} else if ( param == NULL ) {
+			param = argv[i];
+		} else if ( filter == 0 ) {
+			value = argv[i];
+			filter = 1;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if ( param == NULL )
+		usage(argv[0]);
+
+	sqlite3_stmt *select_params = NULL;
+	if ( prepare(find_sql[count][filter], &select_params) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_params, 1, param, -1, SQLITE_STATIC) != SQLITE_OK ||
+	     (value != NULL && sqlite3_bind_text(select_params, 2, value, -1, SQLITE_STATIC) != SQLITE_OK) ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		fail(EX_SOFTWARE);
+	}
+	if ( count ) {
+		print_count(select_params);
+		return;
+	}
+
+	int is_empty = 1;
+	while ( 1 ) {
+		switch ( step(select_params) ) {
+			case SQLITE_DONE:
+				release(select_params);
+				if ( is_empty ) {
+					fprintf(stderr, "No config sets \"%s\"%s.\n", param, filter ? " to a matching value" : "");
+					fail(1);
+				}
+				return;
+
+			case SQLITE_ROW: {
+				const unsigned char *name  = sqlite3_column_text(select_params, 0);
+				const unsigned char *found = sqlite3_column_text(select_params, 1);
+				is_empty = 0;
+
+				if ( found != NULL && printf("%s %s\n", name, found) < 0 ) {
+					release(select_params);
+					fputs("failed to write to standard output.\n", stderr);
+					fail(EX_IOERR);
+				}
+				if ( found == NULL && printf("%s\n", name) < 0 ) {
+					release(select_params);
+					fputs("failed to write to standard output.\n", stderr);
+					fail(EX_IOERR);
+				}
+				break;
+			}
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_params);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}
+
+// Lists the configs a file is attached to by a range over EdgeByFile.
+void users_of(int argc, const char *argv[]) {
+	int count = 0;
+
+	if ( argc < 4 )
+		usage(argv[0]);
+	for ( int i = 4; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--count") == 0 )
+			count = 1;
+		else
+			usage(argv[0]);
+	}
+
+	sqlite3_stmt *select_edges = NULL;
+	if ( prepare(count ? "SELECT count(*) FROM Edges WHERE File = ?;" : "SELECT Name FROM Edges WHERE File = ?;", &select_edges) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_edges);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_edges, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_edges);
+		fail(EX_SOFTWARE);
+	}
+	if ( count ) {
+		print_count(select_edges);
+		return;
+	}
+
+	int is_empty = 1;
+	while ( 1 ) {
+		switch ( step(select_edges) ) {
+			case SQLITE_DONE:
+				release(select_edges);
+				if ( is_empty ) {
+					fprintf(stderr, "The file named \"%s\" is not attached to any config.\n", argv[3]);
+					fail(1);
+				}
+				return;
+
+			case SQLITE_ROW:
+				is_empty = 0;
+				if ( printf("%s\n", sqlite3_column_text(select_edges, 0)) < 0 ) {
+					release(select_edges);
+					fputs("failed to write to standard output.\n", stderr);
+					fail(EX_IOERR);
+				}
+				break;
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_edges);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}
+
+void close_archive(struct archive *a) {
+	if ( archive_write_close(a) != ARCHIVE_OK ) {
+		fprintf(stderr, "failed to close archive : %s\n", archive_error_string(a));
+		archive_write_free(a);
+		fail(EX_IOERR);
+	}
+	archive_write_free(a);
+}
+
+struct archive *open_archive(const char *compression) {
+	struct archive *a = archive_write_new();
+	int r;
+
+	if ( a == NULL ) {
+		fputs("failed to allocate archive.\n", stderr);
+		fail(EX_OSERR);
+	}
+
+	if ( compression == NULL || strcmp(compression, "gzip") == 0 ) {
+		r = archive_write_add_filter_gzip(a);
+	} else if ( strcmp(compression, "zstd") == 0 ) {
+		r = archive_write_add_filter_zstd(a);
+	} else if ( strcmp(compression, "none") == 0 ) {
+		r = archive_write_add_filter_none(a);
+	} else {
+		fprintf(stderr, "unknown compression \"%s\". Use none, gzip or zstd.\n", compression);
+		archive_write_free(a);
+		fail(EX_USAGE);
+	}
+	if ( r != ARCHIVE_OK ) {
+		fprintf(stderr, "failed to set compression : %s\n", archive_error_string(a));
+		archive_write_free(a);
+		fail(EX_SOFTWARE);
+	}
+	// Don't pad compressed streams with zeros, decompressors choke on them.
+	if ( compression == NULL || strcmp(compression, "none") != 0 )
+		archive_write_set_bytes_in_last_block(a, 1);
+
+	if ( archive_write_set_format_pax_restricted(a) != ARCHIVE_OK ) {
+		fprintf(stderr, "failed to set archive format : %s\n", archive_error_string(a));
+		archive_write_free(a);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( archive_write_open_fd(a, STDOUT_FILENO) != ARCHIVE_OK ) {
+		fprintf(stderr, "failed to open archive : %s\n", archive_error_string(a));
+		archive_write_free(a);
+		fail(EX_IOERR);
+	}
+
+	return a;
+}
+
+int fprint_param(FILE *out, const unsigned char *param, const unsigned char *value) {
+	return value != NULL ? fprintf(out, "%s %s\n", param, value) : fprintf(out, "%s\n", param);
+}
+
+// Renders the config into a malloc()ed buffer because the archive header
+// needs the length before the first byte of data is written.
+char *render_conf(const char *name, size_t *len) {
+	sqlite3_stmt *select_name = NULL;
+	char *buf = NULL;
+	FILE *out;
+	int is_empty = 1;
+
+	if ( (out = open_memstream(&buf, len)) == NULL ) {
+		perror("failed to open memory stream");
+		fail(EX_OSERR);
+	}
+	OWN(buf, free);
+	OWN(out, close_stream);
+
+	if ( prepare("SELECT Param, Value FROM Params WHERE Name = ?;", &select_name) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_name);
+		fail(EX_SOFTWARE);
+	}
+
+	if ( sqlite3_bind_text(select_name, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_name);
+		fail(EX_SOFTWARE);
+	}
+
+	while ( 1 ) {
+		switch ( step(select_name) ) {
+			case SQLITE_DONE:
+				release(select_name);
+				disown(1);
+				if ( fclose(out) ) {
+					perror("failed to close memory stream");
+					fail(EX_OSERR);
+				}
+				disown(1);
+				if ( is_empty ) {
+					free(buf);
+					return NULL;
+				}
+				return buf;
+
+			case SQLITE_ROW: {
+				const unsigned char *param = sqlite3_column_text(select_name, 0);
+				const unsigned char *value = sqlite3_column_text(select_name, 1);
+				is_empty = 0;
+
+				if ( fprint_param(out, param, value) < 0 ) {
+					release(select_name);
+					fputs("failed to write to memory stream.\n", stderr);
+					fail(EX_OSERR);
+				}
+				break;
+			}
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_name);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}
+
+char *join_path(const char *dir, const char *name) {
+	size_t len = strlen(dir) + strlen(name) + 2;
+	char *path = malloc(len);
+
+	if ( path == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+// Writes the header of a regular file or, if link isn't NULL, of a hardlink
+// to an earlier entry of the archive.
+void archive_header(struct archive *a, const char *path, sqlite3_int64 size, int perm, const char *link) {
+	struct archive_entry *entry = archive_entry_new();
+
+	if ( entry == NULL ) {
+		fputs("failed to allocate archive entry.\n", stderr);
+		fail(EX_OSERR);
+	}
+
+	archive_entry_set_pathname(entry, path);
+	archive_entry_set_size(entry, link == NULL ? size : 0);
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, perm);
+	archive_entry_set_mtime(entry, time(NULL), 0);
+	if ( link != NULL )
+		archive_entry_set_hardlink(entry, link);
+	if ( archive_write_header(a, entry) != ARCHIVE_OK ) {
+		fprintf(stderr, "failed to write archive header for \"%s\" : %s\n", path, archive_error_string(a));
+		fail(EX_IOERR);
+	}
+	archive_entry_free(entry);
+}
+
+void archive_data(struct archive *a, const void *buf, size_t len) {
+	const double t = stats_clock();
+	if ( archive_write_data(a, buf, len) != (la_ssize_t) len ) {
+		fprintf(stderr, "failed to write archive data : %s\n", archive_error_string(a));
+		fail(EX_IOERR);
+	}
+	stats.output += stats_clock() - t;
+}
+
+void archive_sink(void *ctx, const uint8_t *buf, size_t len) {
+	archive_data((struct archive*) ctx, buf, len);
+}
+
+// Writes the rendered config as <NAME>/<NAME>.conf.
+void archive_conf(struct archive *a, const char *name, const char *conf, size_t len) {
+	size_t conf_name_len = strlen(name) + sizeof(".conf");
+	char *conf_name = malloc(conf_name_len);
+
+	if ( conf_name == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	snprintf(conf_name, conf_name_len, "%s.conf", name);
+
+	char *path = join_path(name, conf_name);
+	archive_header(a, path, len, 0644, NULL);
+	archive_data(a, conf, len);
+	free(path);
+	free(conf_name);
+}
+
+void write_archive(int argc, const char *argv[]) {
+	if ( argc != 4 && argc != 5 ) {
+		usage(argv[0]);
+	}
+
+	const char *name = argv[3];
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+
+	size_t conf_len;
+	char *conf = render_conf(name, &conf_len);
+	if ( conf == NULL ) {
+		fprintf(stderr, "Their is no config named \"%s\".\n", name);
+		fail(1);
+	}
+	OWN(conf, free);
+
+	sqlite3_stmt *select_files = NULL;
+	if ( prepare("SELECT Edges.File, " FILE_COLUMNS_SQL " FROM Edges LEFT JOIN Files ON Files.Name = Edges.File LEFT JOIN Blobs ON Blobs.Id = Files.Blob WHERE Edges.Name = ? ORDER BY Edges.File;", &select_files) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_files);
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_bind_text(select_files, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+		release(select_files);
+		fail(EX_SOFTWARE);
+	}
+
+	struct archive *a = open_archive(argc == 5 ? argv[4] : NULL);
+	archive_conf(a, name, conf, conf_len);
+	free(conf);
+	disown(1);
+
+	file_reader_t reader = { NULL, NULL };
+	while ( 1 ) {
+		switch ( step(select_files) ) {
+			case SQLITE_DONE:
+				release(select_files);
+				close_reader(&reader);
+				commit();
+				close_archive(a);
+				return;
+
+			case SQLITE_ROW: {
+				const unsigned char *file = sqlite3_column_text(select_files, 0);
+				stored_file_t stored;
+
+				if ( sqlite3_column_type(select_files, 1) == SQLITE_NULL ) {
+					fprintf(stderr, "The file named \"%s\" is attached to the config named \"%s\", but not stored in the database.\n", file, name);
+					release(select_files);
+					close_reader(&reader);
+					fail(2);
+				}
+				column_file(select_files, 1, (const char*)file, &stored);
+
+				char *path = join_path(name, (const char*)file);
+				archive_header(a, path, stored.size, 0600, NULL);
+				read_file(&reader, &stored, 0, -1, archive_sink, a);
+				free(path);
+				break;
+			}
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_files);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}
+
+
+// Writes all configs with their attached files into the archive, or with
+// changed set only the configs named in temp.Exported.
+void export_confs(struct archive *a, int changed) {
+	const char *params_sql = changed ?
+		"SELECT Name, Param, Value FROM Params WHERE Name IN temp.Exported ORDER BY Name, Param;" :
+		"SELECT Name, Param, Value FROM Params ORDER BY Name, Param;";
+	const char *files_sql = changed ?
+		"SELECT Edges.File, Edges.Name, " FILE_COLUMNS_SQL " FROM Edges LEFT JOIN Files ON Files.Name = Edges.File LEFT JOIN Blobs ON Blobs.Id = Files.Blob WHERE Edges.Name IN temp.Exported ORDER BY Blobs.Id, Edges.File, Edges.Name;" :
+		"SELECT Edges.File, Edges.Name, " FILE_COLUMNS_SQL " FROM Edges LEFT JOIN Files ON Files.Name = Edges.File LEFT JOIN Blobs ON Blobs.Id = Files.Blob ORDER BY Blobs.Id, Edges.File, Edges.Name;";
+
+	sqlite3_stmt *select_params = NULL;
+	if ( prepare(params_sql, &select_params) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		fail(EX_SOFTWARE);
+	}
+
+	sqlite3_stmt *select_files = NULL;
+	if ( prepare(files_sql, &select_files) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		release(select_files);
+		fail(EX_SOFTWARE);
+	}
+
+	// The params of each config are adjacent in primary key order, render
+	// one config at a time.
+	char   *name = NULL;
+	char   *conf = NULL;
+	size_t  conf_len = 0;
+	FILE   *out = NULL;
+	int     done = 0;
+	while ( !done ) {
+		int row = step(select_params);
+		if ( row != SQLITE_ROW && row != SQLITE_DONE ) {
+			fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+			release(select_params);
+			release(select_files);
+			fail(EX_SOFTWARE);
+		}
+
+		const unsigned char *next = row == SQLITE_ROW ? sqlite3_column_text(select_params, 0) : NULL;
+		if ( name != NULL && (next == NULL || strcmp(name, (const char*)next) != 0) ) {
+			if ( fclose(out) ) {
+				perror("failed to close memory stream");
+				fail(EX_OSERR);
+			}
+			archive_conf(a, name, conf, conf_len);
+			free(conf);
+			free(name);
+			name = NULL;
+		}
+		if ( next == NULL ) {
+			done = 1;
+			continue;
+		}
+
+		if ( name == NULL ) {
+			if ( (name = strdup((const char*)next)) == NULL ) {
+				fputs("failed to allocate memory.\n", stderr);
+				fail(EX_OSERR);
+			}
+			if ( (out = open_memstream(&conf, &conf_len)) == NULL ) {
+				perror("failed to open memory stream");
+				fail(EX_OSERR);
+			}
+		}
+		if ( fprint_param(out, sqlite3_column_text(select_params, 1), sqlite3_column_text(select_params, 2)) < 0 ) {
+			fputs("failed to write to memory stream.\n", stderr);
+			fail(EX_OSERR);
+		}
+	}
+	release(select_params);
+
+	// Edges are walked in blob order. The first edge to a content gets the
+	// data, every later one, whether of the same file or of another file with
+	// identical content, a hardlink to that entry. Each blob is read exactly
+	// once.
+	file_reader_t reader = { NULL, NULL };
+	sqlite3_int64 last = 0;
+	char *target = NULL;
+	while ( 1 ) {
+		switch ( step(select_files) ) {
+			case SQLITE_DONE:
+				release(select_files);
+				close_reader(&reader);
+				free(target);
+				return;
+
+			case SQLITE_ROW: {
+				const unsigned char *file = sqlite3_column_text(select_files, 0);
+				const unsigned char *user = sqlite3_column_text(select_files, 1);
+				char *path = join_path((const char*)user, (const char*)file);
+				stored_file_t stored;
+
+				if ( sqlite3_column_type(select_files, 2) == SQLITE_NULL ) {
+					fprintf(stderr, "The file named \"%s\" is attached to the config named \"%s\", but not stored in the database.\n", file, user);
+					release(select_files);
+					close_reader(&reader);
+					fail(2);
+				}
+				column_file(select_files, 2, (const char*)file, &stored);
+
+				if ( stored.id == last ) {
+					archive_header(a, path, 0, 0600, target);
+					free(path);
+					break;
+				}
+
+				archive_header(a, path, stored.size, 0600, NULL);
+				read_file(&reader, &stored, 0, -1, archive_sink, a);
+
+				free(target);
+				target = path;
+				last = stored.id;
+				break;
+			}
+
+			default:
+				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+				release(select_files);
+				fail(EX_SOFTWARE);
+				break;
+		}
+	}
+}
+
+void export_all(int argc, const char *argv[]) {
+	if ( argc != 3 && argc != 4 )
+		usage(argv[0]);
+
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	struct archive *a = open_archive(argc == 4 ? argv[3] : NULL);
+	export_confs(a, 0);
+	commit();
+	close_archive(a);
+}
+
+// Writes a small text file into the root of the archive.
+void archive_text(struct archive *a, const char *path, const char *text, size_t len) {
+	archive_header(a, path, len, 0644, NULL);
+	archive_data(a, text, len);
+}
+
+// export <DB> --since GEN [none|gzip|zstd] exports only the configs whose
+// params or attachments changed after generation GEN or that attach a file
+// changed since, laid out like export-all. .deleted lists the configs
+// ("conf NAME") and files ("file NAME") deleted since and .generation holds
+// the generation to pass as --since next time.
+void export_since(int argc, const char *argv[]) {
+	if ( (argc != 5 && argc != 6) || strcmp(argv[3], "--since") != 0 )
+		usage(argv[0]);
+	sqlite3_int64 since = parse_bytes(argv[4], argv[0]);
+
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	if ( sqlite3_exec(db, "CREATE TEMP TABLE IF NOT EXISTS Exported ( Name STRING NOT NULL, PRIMARY KEY ( Name ) ); DELETE FROM temp.Exported;", NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to create temporary table : %s\n", sqlite3_errmsg(db));
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	exec_ids("INSERT INTO temp.Exported ( Name )\n"
+	         "SELECT Name FROM ConfChanges WHERE Generation > ?1\n"
+	         "UNION\n"
+	         "SELECT Edges.Name FROM FileChanges JOIN Edges ON Edges.File = FileChanges.Name WHERE FileChanges.Generation > ?1;", since, 0);
+
+	struct archive *a = open_archive(argc == 6 ? argv[5] : NULL);
+	export_confs(a, 1);
+
+	sqlite3_stmt *select_deleted = NULL;
+	if ( prepare("SELECT 'conf', Name FROM ConfChanges\n"
+	             "WHERE Generation > ?1 AND NOT EXISTS ( SELECT 1 FROM Params WHERE Params.Name = ConfChanges.Name ) AND\n"
+	             "      NOT EXISTS ( SELECT 1 FROM Edges WHERE Edges.Name = ConfChanges.Name )\n"
+	             "UNION ALL\n"
+	             "SELECT 'file', Name FROM FileChanges\n"
+	             "WHERE Generation > ?1 AND NOT EXISTS ( SELECT 1 FROM Files WHERE Files.Name = FileChanges.Name )\n"
+	             "ORDER BY 1, 2;", &select_deleted) != SQLITE_OK ||
+	     sqlite3_bind_int64(select_deleted, 1, since) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_deleted);
+		fail(EX_SOFTWARE);
+	}
+	char *deleted = NULL;
+	size_t deleted_len = 0;
+	FILE *out = open_memstream(&deleted, &deleted_len);
+	if ( out == NULL ) {
+		perror("failed to open memory stream");
+		fail(EX_OSERR);
+	}
+	OWN(deleted, free);
+	OWN(out, close_stream);
+	int r;
+	while ( (r = step(select_deleted)) == SQLITE_ROW )
+		fprintf(out, "%s %s\n", sqlite3_column_text(select_deleted, 0), sqlite3_column_text(select_deleted, 1));
+	if ( r != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		release(select_deleted);
+		fail(EX_SOFTWARE);
+	}
+	release(select_deleted);
+	disown(1);
+	if ( fclose(out) ) {
+		perror("failed to close memory stream");
+		fail(EX_OSERR);
+	}
+	archive_text(a, ".deleted", deleted, deleted_len);
+	free(deleted);
+	disown(1);
+
+	sqlite3_stmt *select_generation = NULL;
+	if ( prepare("SELECT Value FROM Generation;", &select_generation) != SQLITE_OK || step(select_generation) != SQLITE_ROW ) {
+		fprintf(stderr, "failed to read generation : %s\n", sqlite3_errmsg(db));
+		release(select_generation);
+		fail(EX_SOFTWARE);
+	}
+	char generation[32];
+	int len = snprintf(generation, sizeof(generation), "%lli\n", sqlite3_column_int64(select_generation, 0));
+	release(select_generation);
+	archive_text(a, ".generation", generation, len);
+
+	commit();
+	close_archive(a);
+}
+
+// Feeds libarchive from the read ahead buffers. A buffer stays valid until
+// the next call, just as libarchive expects.
+la_ssize_t prefetch_read(struct archive *a, void *ctx, const void **buf) {
+	ssize_t n = prefetch_next((prefetch_t*) ctx, (const uint8_t**) buf);
+	if ( n < 0 )
+		archive_set_error(a, errno, "%s", strerror(errno));
+	return n;
+}
+
+// Streams the data of the current entry into the blob and hashes it.
+void archive_blob(struct archive *a, const char *path, sqlite3_blob *blob, EVP_MD_CTX *hash) {
+	const int len = sqlite3_blob_bytes(blob);
+	uint8_t buf[STREAM_BUF_SIZE];
+	int off = 0;
+	la_ssize_t n;
+
+	while ( off < len && (n = archive_read_data(a, buf, sizeof(buf))) > 0 ) {
+		if ( n > len - off )
+			n = len - off;
+		const double t = stats_clock();
+		if ( sqlite3_blob_write(blob, buf, (int) n, off) != SQLITE_OK ) {
+			fprintf(stderr, "failed to write to blob : %s\n", sqlite3_errmsg(db));
+			sqlite3_blob_close(blob);
+			fail(EX_IOERR);
+		}
+		stats.blob_io += stats_clock() - t;
+		stats.blob_written += n;
+		EVP_DigestUpdate(hash, buf, n);
+		off += n;
+	}
+	if ( off < len ) {
+		fprintf(stderr, "failed to read %s from the archive : %s\n", path,
+		        archive_error_string(a) != NULL ? archive_error_string(a) : "unexpected end of data");
+		sqlite3_blob_close(blob);
+		fail(EX_DATAERR);
+	}
+}
+
+// put-files <DB> [--attach NAME] stores every regular file of a tar read
+// from stdin, plain or compressed with any filter libarchive knows, under
+// its path in the archive. The data of each entry streams into a zeroblob
+// of the size in its header, and everything is stored in one transaction.
+// With --attach the files are attached to the config NAME as well.
+void put_files(int argc, const char *argv[]) {
+	const char *attach = NULL;
+	size_t n_files = 0;
+	sqlite3_int64 n_bytes = 0;
+
+	if ( argc == 5 && strcmp(argv[3], "--attach") == 0 )
+		attach = argv[4];
+	else if ( argc != 3 )
+		usage(argv[0]);
+
+	struct archive *a = archive_read_new();
+	if ( a == NULL ) {
+		fputs("failed to allocate archive.\n", stderr);
+		fail(EX_OSERR);
+	}
+	prefetch_t input;
+	open_prefetch(&input, STDIN_FILENO, STREAM_BUF_SIZE, -1);
+	if ( archive_read_support_filter_all(a) != ARCHIVE_OK ||
+	     archive_read_support_format_tar(a) != ARCHIVE_OK ||
+	     archive_read_open(a, &input, NULL, prefetch_read, NULL) != ARCHIVE_OK ) {
+		fprintf(stderr, "failed to open archive : %s\n", archive_error_string(a));
+		archive_read_free(a);
+		fail(EX_DATAERR);
+	}
+
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+
+	struct archive_entry *entry;
+	int r;
+	while ( (r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN ) {
+		const char *path = archive_entry_pathname(entry);
+		if ( path == NULL )
+			continue;
+		while ( strncmp(path, "./", 2) == 0 )
+			path += 2;
+
+		// Archives written by export-all store a file with the same content
+		// as an earlier entry as a hardlink to it.
+		const char *link = archive_entry_hardlink(entry);
+		if ( link != NULL ) {
+			while ( strncmp(link, "./", 2) == 0 )
+				link += 2;
+			const sqlite3_int64 id = file_blob(link);
+			if ( id == 0 ) {
+				fprintf(stderr, "the entry %s links to %s, which isn't stored.\n", path, link);
+				rollback();
+				fail(EX_DATAERR);
+			}
+			map_file(path, id);
+			if ( attach != NULL )
+				insert_edge(attach, path);
+			n_files++;
+			continue;
+		}
+		if ( archive_entry_filetype(entry) != AE_IFREG ) {
+			if ( archive_entry_filetype(entry) != AE_IFDIR )
+				fprintf(stderr, "skipped the entry %s, it isn't a regular file.\n", path);
+			continue;
+		}
+
+		const sqlite3_int64 size = archive_entry_size(entry);
+		if ( !archive_entry_size_is_set(entry) || size > INT_MAX ) {
+			fprintf(stderr, "the entry %s has no size or is larger than a blob, store it with put-file.\n", path);
+			rollback();
+			fail(EX_DATAERR);
+		}
+
+		sqlite3_int64 id = insert_blob(NULL, size, 0);
+		insert_content(id, size);
+		EVP_MD_CTX *hash = new_digest();
+		if ( size > 0 ) {
+			sqlite3_blob *blob = NULL;
+			if ( sqlite3_blob_open(db, "main", "Contents", "Content", id, 1, &blob) != SQLITE_OK ) {
+				fprintf(stderr, "failed to open blob for writing : %s\n", sqlite3_errmsg(db));
+				sqlite3_blob_close(blob);
+				fail(EX_SOFTWARE);
+			}
+			archive_blob(a, path, blob, hash);
+			set_type_from_blob(id, blob);
+			sqlite3_blob_close(blob);
+		} else {
+			set_type(id, NULL, 0);
+		}
+		uint8_t digest[DIGEST_LEN];
+		finish_digest(hash, digest);
+		map_file(path, dedup_blob(id, digest, size));
+		if ( attach != NULL )
+			insert_edge(attach, path);
+		n_files++;
+		n_bytes += size;
+	}
+	if ( r != ARCHIVE_EOF ) {
+		fprintf(stderr, "failed to read archive : %s\n", archive_error_string(a));
+		rollback();
+		fail(EX_DATAERR);
+	}
+	archive_read_free(a);
+	close_prefetch(&input);
+
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	printf("stored %zu files with %lli bytes%s%s.\n", n_files, n_bytes, attach != NULL ? " attached to " : "", attach != NULL ? attach : "");
+}
+
+// render <DB> <NAME> prints the config as a unified profile with every
+// attached file a param refers to inlined as a <param> block. Rendering only
+// uses the connection it is given and reports errors by its return value,
+// so it can run on worker threads with their own connections.
+typedef struct profile_renderer {
+	sqlite3      *db;
+	sqlite3_stmt *select_conf;
+	sqlite3_stmt *select_chunks;
+	sqlite3_stmt *select_dict;
+	inflater_t    inflater;
+} profile_renderer_t;
+
+// A param refers to an attached file if its value is the file name, maybe
+// followed by arguments as in "tls-auth ta.key 0". Inline contents come
+// with the join, chunked files are read separately.
+#define SELECT_PROFILE_SQL \
+	"SELECT Params.Param, Params.Value, Blobs.Id, Blobs.Chunked, Contents.Content, length(Edges.File), Blobs.Codec, Blobs.Dict\n" \
+	"FROM Params\n" \
+	"LEFT JOIN Edges ON Edges.Name = Params.Name AND\n" \
+	"    ( Edges.File = Params.Value OR substr(Params.Value, 1, length(Edges.File) + 1) = Edges.File || ' ' )\n" \
+	"LEFT JOIN Files ON Files.Name = Edges.File\n" \
+	"LEFT JOIN Blobs ON Blobs.Id = Files.Blob\n" \
+	"LEFT JOIN Contents ON Contents.Blob = Blobs.Id AND NOT Blobs.Chunked\n" \
+	"WHERE Params.Name = ?\n" \
+	"ORDER BY Params.Param;"
+
+#define SELECT_CHUNKS_SQL "SELECT Data FROM Chunks WHERE Blob = ? ORDER BY Seq;"
+
+int open_renderer(profile_renderer_t *r, sqlite3 *conn) {
+	r->db = conn;
+	r->select_conf = r->select_chunks = r->select_dict = NULL;
+	memset(&r->inflater, 0, sizeof(r->inflater));
+	if ( check_plans > 0 && (check_plan(conn, SELECT_PROFILE_SQL, NULL) || check_plan(conn, SELECT_CHUNKS_SQL, NULL) ||
+	                         check_plan(conn, SELECT_DICT_SQL, NULL)) )
+		return EX_SOFTWARE;
+	if ( sqlite3_prepare_v3(conn, SELECT_PROFILE_SQL, -1, SQLITE_PREPARE_PERSISTENT, &r->select_conf, NULL) != SQLITE_OK ||
+	     sqlite3_prepare_v3(conn, SELECT_CHUNKS_SQL, -1, SQLITE_PREPARE_PERSISTENT, &r->select_chunks, NULL) != SQLITE_OK ||
+	     sqlite3_prepare_v3(conn, SELECT_DICT_SQL, -1, SQLITE_PREPARE_PERSISTENT, &r->select_dict, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(conn));
+		sqlite3_finalize(r->select_conf);
+		sqlite3_finalize(r->select_chunks);
+		sqlite3_finalize(r->select_dict);
+		return EX_SOFTWARE;
+	}
+	return 0;
+}
+
+void close_renderer(profile_renderer_t *r) {
+	sqlite3_finalize(r->select_conf);
+	sqlite3_finalize(r->select_chunks);
+	sqlite3_finalize(r->select_dict);
+	free_inflater(&r->inflater);
+}
+
+void stdio_sink(void *ctx, const uint8_t *buf, size_t len) {
+	fwrite(buf, 1, len, (FILE*) ctx);
+}
+
+int render_chunks(profile_renderer_t *r, sqlite3_int64 id, int codec, sqlite3_int64 dict, FILE *out, int *last) {
+	inflater_t *z = &r->inflater;
+	int rc, status;
+
+	if ( sqlite3_bind_int64(r->select_chunks, 1, id) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(r->db));
+		return EX_SOFTWARE;
+	}
+	while ( (rc = step(r->select_chunks)) == SQLITE_ROW ) {
+		const uint8_t *data = sqlite3_column_blob(r->select_chunks, 0);
+		int n = sqlite3_column_bytes(r->select_chunks, 0);
+		if ( codec != CODEC_NONE ) {
+			z->skip = 0;
+			z->left = INT64_MAX;
+			z->last = *last;
+			z->sink = stdio_sink;
+			z->ctx = out;
+			status = start_frame(z, r->select_dict, dict);
+			if ( status == 0 )
+				status = inflate_frame(z, data, n);
+			if ( status == 0 && z->pending != 0 ) {
+				fputs("a chunk of an attached file is truncated.\n", stderr);
+				status = EX_DATAERR;
+			}
+			if ( status == 0 && ferror(out) )
+				status = EX_IOERR;
+			if ( status != 0 ) {
+				sqlite3_reset(r->select_chunks);
+				return status;
+			}
+			*last = z->last;
+			continue;
+		}
+		if ( n > 0 && fwrite(data, 1, n, out) != (size_t) n ) {
+			sqlite3_reset(r->select_chunks);
+			return EX_IOERR;
+		}
+		if ( n > 0 )
+			*last = data[n - 1];
+	}
+	sqlite3_reset(r->select_chunks);
+	if ( rc != SQLITE_DONE ) {
+		fprintf(stderr, "failed to read chunks : %s\n", sqlite3_errmsg(r->db));
+		return EX_SOFTWARE;
+	}
+	return 0;
+}
+
+// Returns 0, 1 if there is no such config or an exit status on errors.
+int render_profile(profile_renderer_t *r, const char *name, FILE *out) {
+	int status = 0, is_empty = 1, rc;
+
+	if ( sqlite3_bind_text(r->select_conf, 1, name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(r->db));
+		return EX_SOFTWARE;
+	}
+	while ( status == 0 && (rc = step(r->select_conf)) == SQLITE_ROW ) {
+		const char *param = (const char*) sqlite3_column_text(r->select_conf, 0);
+		const char *value = (const char*) sqlite3_column_text(r->select_conf, 1);
+		is_empty = 0;
+
+		// An inline block can't carry arguments after the file name. The
+		// key direction of tls-auth moves into its own param, any other
+		// param with arguments is written unchanged and not inlined.
+		const char *args = value + sqlite3_column_int(r->select_conf, 5);
+		args += strspn(args, " \t");
+		const int attached = sqlite3_column_type(r->select_conf, 2) != SQLITE_NULL;
+		const int has_args = attached && *args != '\0';
+		if ( !attached || (has_args && strcmp(param, "tls-auth") != 0) ) {
+			if ( fprint_param(out, (const unsigned char*) param, (const unsigned char*) value) < 0 )
+				status = EX_IOERR;
+			continue;
+		}
+		if ( has_args && fprintf(out, "key-direction %s\n", args) < 0 ) {
+			status = EX_IOERR;
+			break;
+		}
+
+		int last = '\n';
+		if ( fprintf(out, "<%s>\n", param) < 0 ) {
+			status = EX_IOERR;
+			break;
+		}
+		if ( sqlite3_column_int(r->select_conf, 3) ) {
+			status = render_chunks(r, sqlite3_column_int64(r->select_conf, 2), sqlite3_column_int(r->select_conf, 6),
+			                       sqlite3_column_int64(r->select_conf, 7), out, &last);
+		} else {
+			const uint8_t *data = sqlite3_column_blob(r->select_conf, 4);
+			int n = sqlite3_column_bytes(r->select_conf, 4);
+			if ( n > 0 && fwrite(data, 1, n, out) != (size_t) n )
+				status = EX_IOERR;
+			if ( n > 0 )
+				last = data[n - 1];
+		}
+		if ( status == 0 && fprintf(out, "%s</%s>\n", last == '\n' ? "" : "\n", param) < 0 )
+			status = EX_IOERR;
+	}
+	if ( status == 0 && rc != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(r->db));
+		status = EX_SOFTWARE;
+	}
+	sqlite3_reset(r->select_conf);
+
+	if ( status == EX_IOERR )
+		fputs("failed to write the profile.\n", stderr);
+	if ( status == 0 && is_empty ) {
+		fprintf(stderr, "Their is no config named \"%s\".\n", name);
+		status = 1;
+	}
+	return status;
+}
+
+void render(int argc, const char *argv[]) {
+	profile_renderer_t r;
+	int status;
+
+	if ( argc != 4 )
+		usage(argv[0]);
+
+	// The profile goes out through stdout's buffer in large writes.
+	setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	if ( (status = open_renderer(&r, db)) != 0 )
+		fail(status);
+	status = render_profile(&r, argv[3], stdout);
+	close_renderer(&r);
+	commit();
+	if ( status == 0 && fflush(stdout) != 0 ) {
+		fputs("failed to write to standard output.\n", stderr);
+		status = EX_IOERR;
+	}
+	if ( status != 0 )
+		fail(status);
+}
+
+// import-dir: worker threads read and parse configs and hash files while
+// this thread, the only writer, imports the whole tree in one transaction.
+// Configs are DIR/**/*.conf, DIR/**/*.ovpn and every file in a ccd/ directory,
+// files are everything below DIR/pki/ and whatever the configs reference.
+const char *const file_params[] = { // keep sorted
+	"ca", "cert", "dh", "extra-certs", "key", "pkcs12", "tls-auth", "tls-crypt", "tls-crypt-v2"
+};
+
+typedef struct import_block {
+	char              *tag;
+	const uint8_t     *body;
+	size_t             len;
+	uint8_t            digest[DIGEST_LEN];
+} import_block_t;
+
+typedef struct import_job {
+	struct import_job *next;     // in the queue of finished jobs
+	char              *path;
+	char              *name;
+	char              *dir;      // configs : directory relative paths are tried first
+	int                is_conf;
+	int                error;    // errno of a failed read, 0 on success
+	char              *text;     // configs : the whole file, params point into it
+	char             **params;   //           param and value pairs
+	size_t             n_params;
+	import_block_t    *blocks;   //           inline blocks
+	size_t             n_blocks;
+	char              *unclosed; //           tag of an inline block missing its end
+	uint8_t           *map;      // files   : the content, NULL if empty or too large for a blob
+	sqlite3_int64      size;
+	uint8_t            digest[DIGEST_LEN];
+} import_job_t;
+
+typedef struct import_edge {
+	const char *name;
+	char       *file;
+} import_edge_t;
+
+typedef struct import_queue {
+	pthread_mutex_t   lock;
+	pthread_cond_t    done;      // a worker finished a job
+	pthread_cond_t    space;     // the writer took a finished job
+	import_job_t    **jobs;
+	size_t            n_jobs;
+	size_t            next_job;
+	import_job_t     *head;
+	import_job_t    **tail;
+	size_t            queued;
+} import_queue_t;
+
+// Bounds the parsed configs and mapped files waiting for the writer.
+#define IMPORT_QUEUE_LEN 256
+
+// Growable arrays of jobs and edges, dying on allocation failure like the
+// rest of the import.
+void *grow(void *array, size_t n, size_t *cap, size_t size) {
+	if ( n < *cap )
+		return array;
+	*cap = *cap ? *cap * 2 : 64;
+	if ( (array = realloc(array, *cap * size)) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	return array;
+}
+
+import_job_t *new_job(const char *path, const char *name, int is_conf) {
+	import_job_t *job = calloc(1, sizeof(import_job_t));
+	if ( job == NULL || (job->path = strdup(path)) == NULL || (job->name = strdup(name)) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	job->is_conf = is_conf;
+	return job;
+}
+
+void free_job(import_job_t *job) {
+	if ( job->map != NULL )
+		munmap(job->map, job->size);
+	free(job->params);
+	free(job->blocks);
+	free(job->text);
+	free(job->dir);
+	free(job->name);
+	free(job->path);
+	free(job);
+}
+
+int cmp_job(const void *a, const void *b) {
+	return strcmp((*(import_job_t *const*) a)->name, (*(import_job_t *const*) b)->name);
+}
+
+int cmp_str(const void *a, const void *b) {
+	return strcmp(*(const char *const*) a, *(const char *const*) b);
+}
+
+// Runs on the workers, so errors are recorded in the job instead of failing.
+void parse_conf_job(import_job_t *job) {
+	struct stat st;
+	size_t cap = 0;
+	int fd;
+
+	if ( (fd = open(job->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0 ) {
+		job->error = errno;
+		if ( fd >= 0 )
+			close(fd);
+		return;
+	}
+	if ( (job->text = malloc(st.st_size + 1)) == NULL ) {
+		job->error = errno;
+		close(fd);
+		return;
+	}
+	size_t len = 0;
+	while ( len < (size_t) st.st_size ) {
+		ssize_t delta = read(fd, job->text + len, st.st_size - len);
+		if ( delta > 0 )
+			len += delta;
+		else if ( delta == 0 )
+			break;
+		else if ( errno != EINTR ) {
+			job->error = errno;
+			close(fd);
+			return;
+		}
+	}
+	close(fd);
+	job->text[len] = '\0';
+
+	char *rest = job->text, *line, *param, *value, *tag;
+	size_t blocks_cap = 0;
+	while ( (line = strsep(&rest, "\n")) != NULL ) {
+		if ( (tag = block_start(line)) != NULL ) {
+			// The body stays in place, its newlines are put back.
+			const char *body = rest;
+			while ( (line = strsep(&rest, "\n")) != NULL && !is_block_end(line, tag) ) {
+				if ( rest != NULL )
+					rest[-1] = '\n';
+			}
+			if ( line == NULL ) {
+				job->unclosed = tag;
+				return;
+			}
+			if ( job->n_blocks == blocks_cap ) {
+				import_block_t *blocks = realloc(job->blocks, (blocks_cap = blocks_cap ? blocks_cap * 2 : 4) * sizeof(import_block_t));
+				if ( blocks == NULL ) {
+					job->error = errno;
+					return;
+				}
+				job->blocks = blocks;
+			}
+			import_block_t *block = &job->blocks[job->n_blocks++];
+			block->tag = tag;
+			block->body = (const uint8_t*) body;
+			block->len = line - body;
+			if ( EVP_Digest(block->len > 0 ? block->body : (const uint8_t*) "", block->len, block->digest, NULL, EVP_sha256(), NULL) != 1 ) {
+				job->error = EIO;
+				return;
+			}
+			continue;
+		}
+		if ( !parse_line(line, &param, &value) )
+			continue;
+		if ( job->n_params + 2 > cap ) {
+			char **params = realloc(job->params, (cap = cap ? cap * 2 : 64) * sizeof(char*));
+			if ( params == NULL ) {
+				job->error = errno;
+				return;
+			}
+			job->params = params;
+		}
+		job->params[job->n_params++] = param;
+		job->params[job->n_params++] = value;
+	}
+}
+
+void hash_file_job(import_job_t *job) {
+	struct stat st;
+	int fd;
+
+	if ( (fd = open(job->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0 ) {
+		job->error = errno;
+		if ( fd >= 0 )
+			close(fd);
+		return;
+	}
+	job->size = st.st_size;
+	// Files too large for a blob are streamed into chunks by the writer.
+	if ( job->size > INT_MAX ) {
+		close(fd);
+		return;
+	}
+	if ( job->size > 0 ) {
+		job->map = mmap(NULL, job->size, PROT_READ, MAP_SHARED, fd, 0);
+		if ( job->map == MAP_FAILED ) {
+			job->error = errno;
+			job->map = NULL;
+			close(fd);
+			return;
+		}
+	}
+	close(fd);
+	if ( EVP_Digest(job->map != NULL ? job->map : (const uint8_t*) "", job->size, job->digest, NULL, EVP_sha256(), NULL) != 1 )
+		job->error = EIO;
+}
+
+void *import_worker(void *arg) {
+	import_queue_t *q = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		if ( q->next_job == q->n_jobs ) {
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+		import_job_t *job = q->jobs[q->next_job++];
+		pthread_mutex_unlock(&q->lock);
+
+		if ( job->is_conf )
+			parse_conf_job(job);
+		else
+			hash_file_job(job);
+
+		pthread_mutex_lock(&q->lock);
+		while ( q->queued >= IMPORT_QUEUE_LEN )
+			pthread_cond_wait(&q->space, &q->lock);
+		*q->tail = job;
+		q->tail = &job->next;
+		q->queued++;
+		pthread_cond_signal(&q->done);
+		pthread_mutex_unlock(&q->lock);
+	}
+}
+
+// Hands the jobs to up to n_threads workers and passes each finished job to
+// write in the order they complete.
+void run_import(import_job_t **jobs, size_t n_jobs, int n_threads, void (*write)(import_job_t *job, void *ctx), void *ctx) {
+	import_queue_t q = { .jobs = jobs, .n_jobs = n_jobs };
+	pthread_t threads[n_threads];
+	int started = 0;
+
+	q.tail = &q.head;
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.done, NULL);
+	pthread_cond_init(&q.space, NULL);
+	for ( ; started < n_threads && (size_t) started < n_jobs; started++ ) {
+		if ( pthread_create(&threads[started], NULL, import_worker, &q) != 0 ) {
+			if ( started == 0 ) {
+				fputs("failed to start worker threads.\n", stderr);
+				fail(EX_OSERR);
+			}
+			break;
+		}
+	}
+
+	for ( size_t i = 0; i < n_jobs; i++ ) {
+		pthread_mutex_lock(&q.lock);
+		while ( q.head == NULL )
+			pthread_cond_wait(&q.done, &q.lock);
+		import_job_t *job = q.head;
+		if ( (q.head = job->next) == NULL )
+			q.tail = &q.head;
+		q.queued--;
+		pthread_cond_signal(&q.space);
+		pthread_mutex_unlock(&q.lock);
+
+		write(job, ctx);
+	}
+
+	for ( int i = 0; i < started; i++ )
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&q.space);
+	pthread_cond_destroy(&q.done);
+	pthread_mutex_destroy(&q.lock);
+}
+
+typedef struct import {
+	const char      *root;       // real path of DIR
+	size_t           root_len;
+	sqlite3_stmt    *insert_param;
+	import_job_t   **files;
+	size_t           n_files;
+	size_t           files_cap;
+	import_edge_t   *edges;
+	size_t           n_edges;
+	size_t           edges_cap;
+	size_t           n_confs;
+} import_t;
+
+// Resolves a path from a file param to the file it names, relative paths
+// are tried in the directory of the config first and in DIR second. Files
+// below DIR are named by their path relative to DIR, others by their real
+// path. Returns NULL if the file doesn't exist.
+char *resolve_file(import_t *imp, const char *dir, const char *path) {
+	char *real = NULL;
+
+	if ( path[0] == '/' ) {
+		real = realpath(path, NULL);
+	} else {
+		char *joined = join_path(dir, path);
+		real = realpath(joined, NULL);
+		free(joined);
+		if ( real == NULL ) {
+			joined = join_path(imp->root, path);
+			real = realpath(joined, NULL);
+			free(joined);
+		}
+	}
+	if ( real != NULL && strncmp(real, imp->root, imp->root_len) == 0 && real[imp->root_len] == '/' )
+		memmove(real, real + imp->root_len + 1, strlen(real + imp->root_len + 1) + 1);
+	return real;
+}
+
+void write_conf_job(import_job_t *job, void *ctx) {
+	import_t *imp = ctx;
+
+	if ( job->error != 0 ) {
+		fprintf(stderr, "failed to read config %s : %s\n", job->path, strerror(job->error));
+		rollback();
+		fail(EX_IOERR);
+	}
+
+	if ( job->unclosed != NULL ) {
+		fprintf(stderr, "the inline block <%s> in %s isn't closed.\n", job->unclosed, job->path);
+		rollback();
+		fail(EX_DATAERR);
+	}
+
+	if ( sqlite3_bind_text(imp->insert_param, 1, job->name, -1, SQLITE_STATIC) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+		release(imp->insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	for ( size_t i = 0; i < job->n_params; i += 2 ) {
+		const char *param = job->params[i];
+		char *value = job->params[i + 1], *file = NULL, *rewritten = NULL;
+
+		if ( value != NULL && bsearch(&param, file_params, sizeof(file_params) / sizeof(*file_params), sizeof(*file_params), cmp_str) != NULL ) {
+			// The path is the first word of the value, e.g. "ta.key 0".
+			size_t path_len = strcspn(value, " \t\r");
+			char *path = strndup(value, path_len);
+			if ( path == NULL ) {
+				fputs("failed to allocate memory.\n", stderr);
+				fail(EX_OSERR);
+			}
+			if ( strcmp(path, "[inline]") != 0 && (file = resolve_file(imp, job->dir, path)) == NULL )
+				fprintf(stderr, "warning : %s references missing file %s.\n", job->path, path);
+			if ( file != NULL ) {
+				size_t file_len = strlen(file);
+				if ( (rewritten = malloc(file_len + strlen(value + path_len) + 1)) == NULL ) {
+					fputs("failed to allocate memory.\n", stderr);
+					fail(EX_OSERR);
+				}
+				memcpy(rewritten, file, file_len);
+				strcpy(rewritten + file_len, value + path_len);
+				value = rewritten;
+			}
+			free(path);
+		}
+		store_param(imp->insert_param, param, value);
+		free(rewritten);
+
+		if ( file != NULL ) {
+			char *full = file[0] == '/' ? strdup(file) : join_path(imp->root, file);
+			if ( full == NULL ) {
+				fputs("failed to allocate memory.\n", stderr);
+				fail(EX_OSERR);
+			}
+			imp->files = grow(imp->files, imp->n_files, &imp->files_cap, sizeof(import_job_t*));
+			imp->files[imp->n_files++] = new_job(full, file, 0);
+			free(full);
+
+			imp->edges = grow(imp->edges, imp->n_edges, &imp->edges_cap, sizeof(import_edge_t));
+			imp->edges[imp->n_edges].name = job->name;
+			imp->edges[imp->n_edges++].file = file;
+		}
+	}
+	for ( size_t i = 0; i < job->n_blocks; i++ ) {
+		import_block_t *block = &job->blocks[i];
+		store_block(imp->insert_param, job->name, block->tag, block->body, block->len, block->digest);
+	}
+	imp->n_confs++;
+	free(job->blocks);
+	job->blocks = NULL;
+	free(job->params);
+	free(job->text);
+	job->params = NULL;
+	job->text = NULL;
+}
+
+void write_file_job(import_job_t *job, void *ctx) {
+	sqlite3_int64 id;
+
+	if ( job->error != 0 ) {
+		fprintf(stderr, "failed to read file %s : %s\n", job->path, strerror(job->error));
+		rollback();
+		fail(EX_IOERR);
+	}
+	if ( job->size > INT_MAX ) {
+		int fd = open(job->path, O_RDONLY);
+		if ( fd < 0 ) {
+			fprintf(stderr, "failed to open file %s : %s\n", job->path, strerror(errno));
+			rollback();
+			fail(EX_IOERR);
+		}
+		store_chunks(job->name, fd, job->size, NULL, 0);
+		close(fd);
+		return;
+	}
+	id = store_content(job->map, job->size, job->digest);
+	map_file(job->name, id);
+	if ( job->map != NULL ) {
+		munmap(job->map, job->size);
+		job->map = NULL;
+	}
+}
+
+// Strips suffix from the file name if it ends with it.
+int strip_suffix(char *name, const char *suffix) {
+	size_t name_len = strlen(name), suffix_len = strlen(suffix);
+	if ( name_len <= suffix_len || strcmp(name + name_len - suffix_len, suffix) != 0 )
+		return 0;
+	name[name_len - suffix_len] = '\0';
+	return 1;
+}
+
+void import_dir(int argc, const char *argv[]) {
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ( argc != 4 && argc != 6 )
+		usage(argv[0]);
+	if ( argc == 6 ) {
+		char *end;
+		if ( strcmp(argv[4], "--jobs") != 0 )
+			usage(argv[0]);
+		n_threads = strtol(argv[5], &end, 10);
+		if ( *end != '\0' || n_threads < 1 || n_threads > 256 )
+			usage(argv[0]);
+	}
+	if ( n_threads < 1 )
+		n_threads = 1;
+
+	import_t imp = { .root = realpath(argv[3], NULL) };
+	if ( imp.root == NULL ) {
+		fprintf(stderr, "failed to resolve %s : %s\n", argv[3], strerror(errno));
+		fail(EX_NOINPUT);
+	}
+	imp.root_len = strlen(imp.root);
+
+	// Discover configs and the files below pki/.
+	import_job_t **confs = NULL;
+	size_t n_confs = 0, confs_cap = 0;
+	char *const roots[] = { (char*) imp.root, NULL };
+	FTS *fts = fts_open(roots, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	FTSENT *ent;
+	if ( fts == NULL ) {
+		fprintf(stderr, "failed to walk %s : %s\n", imp.root, strerror(errno));
+		fail(EX_NOINPUT);
+	}
+	while ( (ent = fts_read(fts)) != NULL ) {
+		if ( ent->fts_info == FTS_DNR || ent->fts_info == FTS_ERR ) {
+			fprintf(stderr, "failed to walk %s : %s\n", ent->fts_path, strerror(ent->fts_errno));
+			fail(EX_IOERR);
+		}
+		if ( ent->fts_info != FTS_F )
+			continue;
+
+		const char *rel = ent->fts_path + imp.root_len + 1;
+		char *name = strdup(ent->fts_name);
+		if ( name == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			fail(EX_OSERR);
+		}
+		if ( strncmp(rel, "pki/", 4) == 0 ) {
+			imp.files = grow(imp.files, imp.n_files, &imp.files_cap, sizeof(import_job_t*));
+			imp.files[imp.n_files++] = new_job(ent->fts_path, rel, 0);
+		} else if ( (ent->fts_level > 1 && strcmp(ent->fts_parent->fts_name, "ccd") == 0) ||
+		            strip_suffix(name, ".conf") || strip_suffix(name, ".ovpn") ) {
+			confs = grow(confs, n_confs, &confs_cap, sizeof(import_job_t*));
+			confs[n_confs] = new_job(ent->fts_path, name, 1);
+			if ( (confs[n_confs]->dir = strndup(ent->fts_path, ent->fts_pathlen - ent->fts_namelen - 1)) == NULL ) {
+				fputs("failed to allocate memory.\n", stderr);
+				fail(EX_OSERR);
+			}
+			n_confs++;
+		}
+		free(name);
+	}
+	fts_close(fts);
+
+	if ( begin_write() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	if ( prepare("INSERT OR REPLACE INTO Params ( Name, Param, Value ) VALUES ( ?, ?, ? );", &imp.insert_param) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(imp.insert_param);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	run_import(confs, n_confs, (int) n_threads, write_conf_job, &imp);
+	release(imp.insert_param);
+
+	// Configs often share their CA and TLS key, each file is imported once.
+	qsort(imp.files, imp.n_files, sizeof(import_job_t*), cmp_job);
+	size_t n_files = 0;
+	for ( size_t i = 0; i < imp.n_files; i++ ) {
+		if ( n_files > 0 && strcmp(imp.files[n_files - 1]->name, imp.files[i]->name) == 0 )
+			free_job(imp.files[i]);
+		else
+			imp.files[n_files++] = imp.files[i];
+	}
+	imp.n_files = n_files;
+	run_import(imp.files, imp.n_files, (int) n_threads, write_file_job, &imp);
+
+	for ( size_t i = 0; i < imp.n_edges; i++ )
+		insert_edge(imp.edges[i].name, imp.edges[i].file);
+
+	if ( commit() != SQLITE_OK ) {
+		fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	printf("imported %zu configs, %zu files and %zu attachments.\n", imp.n_confs, imp.n_files, imp.n_edges);
+
+	for ( size_t i = 0; i < imp.n_edges; i++ )
+		free(imp.edges[i].file);
+	for ( size_t i = 0; i < imp.n_files; i++ )
+		free_job(imp.files[i]);
+	for ( size_t i = 0; i < n_confs; i++ )
+		free_job(confs[i]);
+	free(imp.edges);
+	free(imp.files);
+	free(confs);
+	free((char*) imp.root);
+}
+
+// serve keeps every config in memory and answers lookups over a Unix socket,
+// query is its client. A request is one line
+//     get NAME PARAM | show NAME | list-attached NAME
+// answered by "STATUS LENGTH\n" followed by LENGTH bytes, the output of the
+// verb if STATUS is 0 and its error message otherwise. STATUS is the exit
+// status of the verb.
+typedef struct cached_conf {
+	struct cached_conf *next;
+	char               *name;
+	char              **params;   // param and value pairs sorted by param, values may be NULL
+	size_t              n_params;
+	size_t              params_cap;
+	char              **files;    // sorted
+	size_t              n_files;
+	size_t              files_cap;
+} cached_conf_t;
+
+typedef struct conf_cache {
+	cached_conf_t **buckets;
+	size_t          n_buckets;    // a power of two
+	size_t          n_confs;
+	sqlite3_int64   version;      // PRAGMA data_version the cache was loaded at
+} conf_cache_t;
+
+char *copy_text(const unsigned char *text) {
+	char *copy;
+
+	if ( text == NULL )
+		return NULL;
+	if ( (copy = strdup((const char*) text)) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	return copy;
+}
+
+cached_conf_t *find_conf(conf_cache_t *cache, const char *name, int create) {
+	cached_conf_t **bucket = &cache->buckets[hash_str(name) & (cache->n_buckets - 1)];
+	cached_conf_t *conf;
+
+	for ( conf = *bucket; conf != NULL; conf = conf->next ) {
+		if ( strcmp(conf->name, name) == 0 )
+			return conf;
+	}
+	if ( !create )
+		return NULL;
+
+	if ( (conf = calloc(1, sizeof(cached_conf_t))) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	conf->name = copy_text((const unsigned char*) name);
+	conf->next = *bucket;
+	*bucket = conf;
+
+	// Keeps the chains short by doubling the table at a load factor of 1.
+	if ( ++cache->n_confs > cache->n_buckets ) {
+		size_t n_buckets = cache->n_buckets * 2;
+		cached_conf_t **buckets = calloc(n_buckets, sizeof(cached_conf_t*));
+		if ( buckets == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			fail(EX_OSERR);
+		}
+		for ( size_t i = 0; i < cache->n_buckets; i++ ) {
+			while ( cache->buckets[i] != NULL ) {
+				cached_conf_t *moved = cache->buckets[i];
+				cache->buckets[i] = moved->next;
+				moved->next = buckets[hash_str(moved->name) & (n_buckets - 1)];
+				buckets[hash_str(moved->name) & (n_buckets - 1)] = moved;
+			}
+		}
+		free(cache->buckets);
+		cache->buckets = buckets;
+		cache->n_buckets = n_buckets;
+	}
+	return conf;
+}
+
+void free_cache(conf_cache_t *cache) {
+	for ( size_t i = 0; i < cache->n_buckets; i++ ) {
+		while ( cache->buckets[i] != NULL ) {
+			cached_conf_t *conf = cache->buckets[i];
+			cache->buckets[i] = conf->next;
+			for ( size_t j = 0; j < conf->n_params; j++ )
+				free(conf->params[j]);
+			for ( size_t j = 0; j < conf->n_files; j++ )
+				free(conf->files[j]);
+			free(conf->params);
+			free(conf->files);
+			free(conf->name);
+			free(conf);
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = NULL;
+	cache->n_buckets = 0;
+	cache->n_confs = 0;
+}
+
+sqlite3_int64 data_version(void) {
+	sqlite3_stmt *select_version = NULL;
+
+	if ( prepare("PRAGMA data_version;", &select_version) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_version);
+		fail(EX_SOFTWARE);
+	}
+	if ( step(select_version) != SQLITE_ROW ) {
+		fprintf(stderr, "failed to read data version : %s\n", sqlite3_errmsg(db));
+		release(select_version);
+		fail(EX_SOFTWARE);
+	}
+	sqlite3_int64 version = sqlite3_column_int64(select_version, 0);
+	release(select_version);
+	return version;
+}
+
+// Reloads the whole cache if another connection changed the database since
+// it was loaded. Both scans follow the primary keys, so configs arrive one
+// after another with their params and files already sorted.
+void refresh_cache(conf_cache_t *cache) {
+	sqlite3_stmt *select_params = NULL, *select_edges = NULL;
+	sqlite3_int64 version = data_version();
+
+	if ( cache->buckets != NULL && version == cache->version )
+		return;
+
+	free_cache(cache);
+	cache->n_buckets = 1024;
+	if ( (cache->buckets = calloc(cache->n_buckets, sizeof(cached_conf_t*))) == NULL ) {
+		fputs("failed to allocate memory.\n", stderr);
+		fail(EX_OSERR);
+	}
+	cache->version = version;
+
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
+	}
+	if ( prepare("SELECT Name, Param, Value FROM Params ORDER BY Name, Param;", &select_params) != SQLITE_OK ||
+	     prepare("SELECT Name, File FROM Edges ORDER BY Name, File;", &select_edges) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		release(select_edges);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+
+	cached_conf_t *conf = NULL;
+	int r;
+	while ( (r = step(select_params)) == SQLITE_ROW ) {
+		const char *name = (const char*) sqlite3_column_text(select_params, 0);
+		if ( conf == NULL || strcmp(conf->name, name) != 0 )
+			conf = find_conf(cache, name, 1);
+		conf->params = grow(conf->params, conf->n_params + 1, &conf->params_cap, sizeof(char*));
+		conf->params[conf->n_params++] = copy_text(sqlite3_column_text(select_params, 1));
+		conf->params[conf->n_params++] = copy_text(sqlite3_column_text(select_params, 2));
+	}
+	if ( r == SQLITE_DONE ) {
+		conf = NULL;
+		while ( (r = step(select_edges)) == SQLITE_ROW ) {
+			const char *name = (const char*) sqlite3_column_text(select_edges, 0);
+			if ( conf == NULL || strcmp(conf->name, name) != 0 )
+				conf = find_conf(cache, name, 1);
+			conf->files = grow(conf->files, conf->n_files, &conf->files_cap, sizeof(char*));
+			conf->files[conf->n_files++] = copy_text(sqlite3_column_text(select_edges, 1));
+		}
+	}
+	if ( r != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		release(select_params);
+		release(select_edges);
+		rollback();
+		fail(EX_SOFTWARE);
+	}
+	release(select_params);
+	release(select_edges);
+	commit();
+}
+
+const char *find_param(const cached_conf_t *conf, const char *param, int *found) {
+	size_t lo = 0, hi = conf->n_params / 2;
+
+	while ( lo < hi ) {
+		size_t mid = (lo + hi) / 2;
+		int c = strcmp(conf->params[2 * mid], param);
+		if ( c == 0 ) {
+			*found = 1;
+			return conf->params[2 * mid + 1];
+		}
+		if ( c < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = 0;
+	return NULL;
+}
+
+// Answers one request line with the same output and exit status as the verb.
+int answer(conf_cache_t *cache, char *line, FILE *out) {
+	char *args[4], *rest = line, *arg;
+	int n = 0;
+
+	while ( n < 4 && (arg = strsep(&rest, " \t\r\n")) != NULL ) {
+		if ( *arg != '\0' )
+			args[n++] = arg;
+	}
+
+	const cached_conf_t *conf = n >= 2 ? find_conf(cache, args[1], 0) : NULL;
+	if ( n == 3 && strcmp(args[0], "get") == 0 ) {
+		int found;
+		const char *value = conf != NULL ? find_param(conf, args[2], &found) : NULL;
+		if ( conf == NULL || conf->n_params == 0 ) {
+			fprintf(out, "their is no config named \"%s\".\n", args[1]);
+			return 1;
+		}
+		if ( value == NULL ) {
+			fprintf(out, "their is parameter named \"%s\" in the config named \"%s\".\n", args[2], args[1]);
+			return 2;
+		}
+		fprintf(out, "%s\n", value);
+	} else if ( n == 2 && strcmp(args[0], "show") == 0 ) {
+		if ( conf == NULL || conf->n_params == 0 ) {
+			fprintf(out, "Their is no config named \"%s\".\n", args[1]);
+			return 1;
+		}
+		for ( size_t i = 0; i < conf->n_params; i += 2 ) {
+			if ( conf->params[i + 1] != NULL )
+				fprintf(out, "%s %s\n", conf->params[i], conf->params[i + 1]);
+			else
+				fprintf(out, "%s\n", conf->params[i]);
+		}
+	} else if ( n == 2 && strcmp(args[0], "list-attached") == 0 ) {
+		if ( conf == NULL || conf->n_files == 0 ) {
+			fprintf(out, "Their is no file attached to the config named \"%s\".\n", args[1]);
+			return 1;
+		}
+		for ( size_t i = 0; i < conf->n_files; i++ )
+			fprintf(out, "%s\n", conf->files[i]);
+	} else {
+		fputs("unsupported request.\n", out);
+		return EX_USAGE;
+	}
+	return 0;
+}
+
+volatile sig_atomic_t stop_serving = 0;
+
+void stop_serve(int sig) {
+	stop_serving = 1;
+}
+
+int open_socket(const char *path, struct sockaddr_un *addr) {
+	int fd;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if ( strlen(path) >= sizeof(addr->sun_path) ) {
+		fprintf(stderr, "the socket path \"%s\" is too long.\n", path);
+		fail(EX_USAGE);
+	}
+	strcpy(addr->sun_path, path);
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+		perror("failed to create socket");
+		fail(EX_OSERR);
+	}
+	return fd;
+}
+
+// Removes a stale socket left by an earlier serve, but nothing else that
+// may sit at a mistyped path. Returns 0 if the path is free.
+int unlink_socket(const char *path) {
+	struct stat st;
+
+	if ( lstat(path, &st) != 0 )
+		return errno == ENOENT ? 0 : -1;
+	if ( !S_ISSOCK(st.st_mode) ) {
+		errno = EEXIST;
+		return -1;
+	}
+	return unlink(path);
+}
+
+// A connected client, the part of its next request read so far and the
+// answers the socket didn't take yet.
+typedef struct serve_client {
+	int     fd;
+	char   *buf;
+	size_t  len;
+	size_t  cap;
+	char   *out;
+	size_t  out_len;
+	size_t  out_cap;
+	int     eof;     // the client sent its last request
+	double  last;    // when the client last sent or took something
+} serve_client_t;
+
+// Requests are single lines, longer ones close the connection. Requests of
+// a client are only read while less than SERVE_MAX_OUT bytes of answers
+// wait for it.
+#define SERVE_MAX_LINE 4096
+#define SERVE_MAX_OUT (1024 * 1024)
+#define SERVE_MAX_CLIENTS 256
+#define SERVE_IDLE_TIMEOUT 5
+
+void append_out(serve_client_t *c, const char *data, size_t len) {
+	if ( c->out_cap - c->out_len < len ) {
+		size_t cap = c->out_cap ? c->out_cap : SERVE_MAX_LINE;
+		while ( cap - c->out_len < len )
+			cap *= 2;
+		char *out = realloc(c->out, cap);
+		if ( out == NULL ) {
+			fputs("failed to allocate memory.\n", stderr);
+			fail(EX_OSERR);
+		}
+		c->out = out;
+		c->out_cap = cap;
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+}
+
+// Answers the complete lines in the client's buffer until enough answers
+// are waiting. Returns -1 if the connection has to be closed.
+int answer_lines(conf_cache_t *cache, serve_client_t *c) {
+	char *body = NULL;
+	size_t body_len = 0, done = 0;
+
+	while ( done < c->len && c->out_len < SERVE_MAX_OUT ) {
+		char *line = c->buf + done, *end = memchr(line, '\n', c->len - done);
+		if ( end == NULL && !c->eof )
+			break;
+		size_t len = end != NULL ? (size_t) (end - line) + 1 : c->len - done;
+		char saved = line[len];
+		line[len] = '\0';
+		done += len;
+
+		FILE *response = open_memstream(&body, &body_len);
+		if ( response == NULL ) {
+			perror("failed to allocate memory");
+			fail(EX_OSERR);
+		}
+		refresh_cache(cache);
+		int status = answer(cache, line, response);
+		fclose(response);
+		line[len] = saved;
+
+		char head[64];
+		int head_len = snprintf(head, sizeof(head), "%i %zu\n", status, body_len);
+		append_out(c, head, head_len);
+		append_out(c, body, body_len);
+		free(body);
+		body = NULL;
+	}
+	memmove(c->buf, c->buf + done, c->len - done);
+	c->len -= done;
+	return c->len >= SERVE_MAX_LINE && memchr(c->buf, '\n', c->len) == NULL ? -1 : 0;
+}
+
+// Writes as much of the waiting answers as the non-blocking socket takes.
+// Returns -1 if the connection failed.
+int flush_out(serve_client_t *c, double t) {
+	size_t done = 0;
+
+	while ( done < c->out_len ) {
+		ssize_t n = write(c->fd, c->out + done, c->out_len - done);
+		if ( n > 0 )
+			done += n;
+		else if ( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+			break;
+		else if ( n < 0 && errno != EINTR )
+			return -1;
+	}
+	if ( done > 0 ) {
+		memmove(c->out, c->out + done, c->out_len - done);
+		c->out_len -= done;
+		c->last = t;
+	}
+	return 0;
+}
+
+void close_client(serve_client_t *clients, size_t *n_clients, size_t i) {
+	close(clients[i].fd);
+	free(clients[i].buf);
+	free(clients[i].out);
+	clients[i] = clients[--*n_clients];
+}
+
+// Clients are multiplexed with poll on non-blocking sockets, so a slow one
+// only waits for itself. A client that neither sends requests nor takes
+// answers for SERVE_IDLE_TIMEOUT seconds is disconnected.
+void serve(int argc, const char *argv[]) {
+	struct sockaddr_un addr;
+	conf_cache_t cache = { .buckets = NULL };
+	serve_client_t clients[SERVE_MAX_CLIENTS];
+	struct pollfd fds[SERVE_MAX_CLIENTS + 1];
+	size_t n_clients = 0;
+
+	if ( argc != 4 )
+		usage(argv[0]);
+
+	int listen_fd = open_socket(argv[3], &addr);
+	if ( unlink_socket(argv[3]) != 0 ) {
+		fprintf(stderr, "failed to remove %s : %s\n", argv[3], strerror(errno));
+		fail(EX_CANTCREAT);
+	}
+	if ( bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0 ) {
+		fprintf(stderr, "failed to listen on %s : %s\n", argv[3], strerror(errno));
+		fail(EX_OSERR);
+	}
+
+	struct sigaction stop = { .sa_handler = stop_serve };
+	sigemptyset(&stop.sa_mask);
+	sigaction(SIGINT, &stop, NULL);
+	sigaction(SIGTERM, &stop, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	refresh_cache(&cache);
+	while ( !stop_serving ) {
+		fds[0] = (struct pollfd) { .fd = listen_fd, .events = n_clients < SERVE_MAX_CLIENTS ? POLLIN : 0 };
+		for ( size_t i = 0; i < n_clients; i++ ) {
+			const serve_client_t *c = &clients[i];
+			fds[i + 1] = (struct pollfd) { .fd = c->fd, .events = (!c->eof && c->out_len < SERVE_MAX_OUT ? POLLIN : 0) |
+			                                                       (c->out_len > 0 ? POLLOUT : 0) };
+		}
+		if ( poll(fds, n_clients + 1, 1000) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			perror("failed to wait for connections");
+			fail(EX_OSERR);
+		}
+
+		// Clients are visited from the end, so closing one moves a client
+		// that was visited already into its place.
+		const double t = now();
+		for ( size_t i = n_clients; i-- > 0; ) {
+			serve_client_t *c = &clients[i];
+			if ( fds[i + 1].revents == 0 ) {
+				if ( t - c->last > SERVE_IDLE_TIMEOUT )
+					close_client(clients, &n_clients, i);
+				continue;
+			}
+			int failed = (fds[i + 1].revents & POLLNVAL) != 0;
+			if ( !failed && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && !c->eof && c->out_len < SERVE_MAX_OUT ) {
+				if ( c->cap - c->len < 512 ) {
+					char *buf = realloc(c->buf, c->cap + SERVE_MAX_LINE);
+					if ( buf == NULL ) {
+						fputs("failed to allocate memory.\n", stderr);
+						fail(EX_OSERR);
+					}
+					c->buf = buf;
+					c->cap += SERVE_MAX_LINE;
+				}
+				ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len - 1);
+				if ( n > 0 ) {
+					c->len += n;
+					c->last = t;
+				} else if ( n == 0 ) {
+					c->eof = 1;
+				} else if ( errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK ) {
+					failed = 1;
+				}
+			}
+			if ( failed || answer_lines(&cache, c) != 0 || flush_out(c, t) != 0 ||
+			     (c->eof && c->len == 0 && c->out_len == 0) )
+				close_client(clients, &n_clients, i);
+		}
+
+		if ( fds[0].revents & POLLIN ) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if ( fd < 0 ) {
+				if ( errno == EINTR || errno == ECONNABORTED || errno == EAGAIN )
+					continue;
+				perror("failed to accept connection");
+				fail(EX_OSERR);
+			}
+			if ( fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ) {
+				perror("failed to make connection non-blocking");
+				close(fd);
+				continue;
+			}
+			clients[n_clients++] = (serve_client_t) { .fd = fd, .last = t };
+		}
+	}
+
+	while ( n_clients > 0 )
+		close_client(clients, &n_clients, n_clients - 1);
+	close(listen_fd);
+	unlink_socket(argv[3]);
+	free_cache(&cache);
+}
+
+// query <SOCKET> <get|show|list-attached> <NAME> [PARAM] asks a running
+// serve instead of opening the database.
+void query(int argc, const char *argv[]) {
+	struct sockaddr_un addr;
+
+	if ( argc < 5 || argc > 6 )
+		usage(argv[0]);
+
+	int fd = open_socket(argv[2], &addr);
+	if ( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+		fprintf(stderr, "failed to connect to %s : %s\n", argv[2], strerror(errno));
+		fail(EX_UNAVAILABLE);
+	}
+
+	char request[4096];
+	int len = snprintf(request, sizeof(request), "%s %s%s%s\n", argv[3], argv[4], argc == 6 ? " " : "", argc == 6 ? argv[5] : "");
+	if ( len < 0 || (size_t) len >= sizeof(request) )
+		usage(argv[0]);
+	if ( write_all(fd, (const uint8_t*) request, len) ) {
+		perror("failed to send request");
+		fail(EX_IOERR);
+	}
+	shutdown(fd, SHUT_WR);
+
+	FILE *in = fdopen(fd, "r");
+	int status;
+	size_t body_len;
+	if ( in == NULL || fscanf(in, "%i %zu", &status, &body_len) != 2 || fgetc(in) != '\n' ) {
+		fputs("failed to read response.\n", stderr);
+		fail(EX_PROTOCOL);
+	}
+	FILE *out = status == 0 ? stdout : stderr;
+	char buf[BUFSIZ];
+	while ( body_len > 0 ) {
+		size_t n = fread(buf, 1, body_len < sizeof(buf) ? body_len : sizeof(buf), in);
+		if ( n == 0 ) {
+			fputs("failed to read response.\n", stderr);
+			fail(EX_PROTOCOL);
+		}
+		if ( fwrite(buf, 1, n, out) != n ) {
+			fputs("failed to write to standard output.\n", stderr);
+			fail(EX_IOERR);
+		}
+		body_len -= n;
+	}
+	fclose(in);
+	if ( status != 0 )
+		fail(status);
+}
+
+// render-all <DB> <OUTDIR> [--jobs N] writes OUTDIR/NAME.ovpn for every
+// config. The sorted names are split into one contiguous range per worker,
+// so each worker walks its own part of the Params B-tree on its own
+// read-only connection.
+typedef struct render_worker {
+	pthread_t     thread;
+	const char   *out_dir;
+	char        **names;
+	size_t        n_names;
+	int           status;   // first failure
+} render_worker_t;
+
+// Opens a read-only connection for a worker thread and begins a read
+// transaction on it. Returns 0 or an exit status.
+int open_worker_db(sqlite3 **conn) {
+	if ( sqlite3_open_v2(db_path, conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to open database : %s\n", sqlite3_errmsg(*conn));
+		sqlite3_close(*conn);
+		return EX_IOERR;
+	}
+	if ( concurrent ) {
+		char pragma[64];
+		snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size = %lli;", mmap_size);
+		sqlite3_busy_timeout(*conn, busy_timeout);
+		sqlite3_exec(*conn, pragma, NULL, NULL, NULL);
+	}
+	if ( sqlite3_exec(*conn, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(*conn));
+		sqlite3_close(*conn);
+		return EX_SOFTWARE;
+	}
+	return 0;
+}
+
+void *render_worker(void *arg) {
+	render_worker_t *w = arg;
+	profile_renderer_t r;
+	sqlite3 *conn = NULL;
+
+	if ( (w->status = open_worker_db(&conn)) != 0 )
+		return NULL;
+	if ( (w->status = open_renderer(&r, conn)) != 0 ) {
+		sqlite3_close(conn);
+		return NULL;
+	}
+
+	for ( size_t i = 0; i < w->n_names && w->status == 0; i++ ) {
+		const char *name = w->names[i];
+		// Names become file names in OUTDIR, so empty, hidden or path-like
+		// names are refused.
+		if ( name[0] == '\0' || name[0] == '.' || strchr(name, '/') != NULL || strstr(name, "..") != NULL ) {
+			fprintf(stderr, "can't render \"%s\" to a file name.\n", name);
+			w->status = EX_DATAERR;
+			break;
+		}
+
+		// Profiles appear complete or not at all.
+		size_t len = strlen(w->out_dir) + strlen(name) + sizeof("/.ovpn.tmp");
+		char path[len], tmp[len];
+		snprintf(path, len, "%s/%s.ovpn", w->out_dir, name);
+		snprintf(tmp, len, "%s.tmp", path);
+
+		FILE *out = fopen(tmp, "w");
+		if ( out == NULL ) {
+			fprintf(stderr, "failed to create %s : %s\n", tmp, strerror(errno));
+			w->status = EX_CANTCREAT;
+			break;
+		}
+		setvbuf(out, NULL, _IOFBF, 256 * 1024);
+		w->status = render_profile(&r, name, out);
+		if ( fclose(out) != 0 && w->status == 0 ) {
+			fprintf(stderr, "failed to write %s : %s\n", tmp, strerror(errno));
+			w->status = EX_IOERR;
+		}
+		if ( w->status == 0 && rename(tmp, path) != 0 ) {
+			fprintf(stderr, "failed to rename %s to %s : %s\n", tmp, path, strerror(errno));
+			w->status = EX_CANTCREAT;
+		}
+		if ( w->status != 0 )
+			unlink(tmp);
+	}
+
+	close_renderer(&r);
+	sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL);
+	sqlite3_close(conn);
+	return NULL;
+}
+
+void render_all(int argc, const char *argv[]) {
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ( argc != 4 && argc != 6 )
+		usage(argv[0]);
+	if ( argc == 6 ) {
+		char *end;
+		if ( strcmp(argv[4], "--jobs") != 0 )
+			usage(argv[0]);
+		n_threads = strtol(argv[5], &end, 10);
+		if ( *end != '\0' || n_threads < 1 || n_threads > 256 )
+			usage(argv[0]);
+	}
+	if ( n_threads < 1 )
+		n_threads = 1;
+
+	sqlite3_stmt *select_names = NULL;
+	if ( prepare("SELECT DISTINCT Name FROM Params ORDER BY Name;", &select_names) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(select_names);
+		fail(EX_SOFTWARE);
+	}
+	char **names = NULL;
+	size_t n_names = 0, names_cap = 0;
+	int r;
+	while ( (r = step(select_names)) == SQLITE_ROW ) {
+		names = grow(names, n_names, &names_cap, sizeof(char*));
+		names[n_names++] = copy_text(sqlite3_column_text(select_names, 0));
+	}
+	if ( r != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+		release(select_names);
+		fail(EX_SOFTWARE);
+	}
+	release(select_names);
+
+	if ( (size_t) n_threads > n_names )
+		n_threads = n_names > 0 ? n_names : 1;
+	render_worker_t workers[n_threads];
+	int started = 0;
+	for ( long i = 0; i < n_threads; i++ ) {
+		size_t first = n_names * i / n_threads, last = n_names * (i + 1) / n_threads;
+		workers[i] = (render_worker_t) { .out_dir = argv[3], .names = names + first, .n_names = last - first, .status = 0 };
+		if ( pthread_create(&workers[i].thread, NULL, render_worker, &workers[i]) != 0 ) {
+			fputs("failed to start worker threads.\n", stderr);
+			fail(EX_OSERR);
+		}
+		started++;
+	}
+
+	int status = 0;
+	for ( int i = 0; i < started; i++ ) {
+		pthread_join(workers[i].thread, NULL);
+		if ( status == 0 )
+			status = workers[i].status;
+	}
+	for ( size_t i = 0; i < n_names; i++ )
+		free(names[i]);
+	free(names);
+	if ( status != 0 )
+		fail(status);
+	printf("rendered %zu profiles.\n", n_names);
+}
+
+// fsck <DB> [--jobs N] [--repair] checks the references between configs,
+// files and blobs and re-hashes every blob.
+//
+// References are checked by merge joins in the main thread: both sides are
+// stepped in the order of an index and advance together, so every table is
+// read once in order instead of being probed row by row. Meanwhile workers
+// on their own read-only connections take batches of blob ids and compare
+// the digest of the content with the stored one.
+typedef struct fsck_queue {
+	pthread_mutex_t lock;
+	sqlite3_int64   next;   // first blob id not handed out yet
+	sqlite3_int64   last;   // largest blob id
+} fsck_queue_t;
+
+#define FSCK_BATCH 64
+
+typedef struct fsck_worker {
+	pthread_t      thread;
+	fsck_queue_t  *queue;
+	sqlite3_int64  blobs;
+	sqlite3_int64  bytes;
+	sqlite3_int64  corrupt;
+	int            status;   // first failure
+} fsck_worker_t;
+
+#define FSCK_BLOBS_SQL "SELECT Id, Digest, Size, Chunked, Codec, Dict FROM Blobs WHERE Id >= ?1 AND Id < ?2 ORDER BY Id;"
+#define FSCK_CHUNKS_SQL "SELECT Seq, Data FROM Chunks WHERE Blob = ? ORDER BY Seq;"
+#define FSCK_NAMES_SQL "SELECT Name FROM Files WHERE Blob = ?;"
+
+typedef struct fsck_blob {
+	sqlite3       *db;
+	sqlite3_stmt  *select_chunks;
+	sqlite3_stmt  *select_dict;
+	sqlite3_blob  *content;
+	inflater_t     inflater;
+} fsck_blob_t;
+
+// Hashes the content of a blob. Returns NULL if it matches the digest, what
+// is wrong with it otherwise. Failures other than corrupt content set status.
+const char *fsck_blob(fsck_blob_t *f, sqlite3_stmt *blob, sqlite3_int64 *bytes, int *status) {
+	const sqlite3_int64 id      = sqlite3_column_int64(blob, 0);
+	const sqlite3_int64 size    = sqlite3_column_int64(blob, 2);
+	const int           chunked = sqlite3_column_int(blob, 3);
+	const int           codec   = sqlite3_column_int(blob, 4);
+	const sqlite3_int64 dict    = sqlite3_column_int64(blob, 5);
+	const char *problem = NULL;
+	sqlite3_int64 len = 0;
+	int rc;
+
+	EVP_MD_CTX *hash = new_digest();
+	if ( !chunked ) {
+		if ( (f->content == NULL ? sqlite3_blob_open(f->db, "main", "Contents", "Content", id, 0, &f->content) :
+		                           sqlite3_blob_reopen(f->content, id)) != SQLITE_OK ) {
+			// A failed reopen leaves the handle aborted.
+			sqlite3_blob_close(f->content);
+			f->content = NULL;
+			problem = "content is missing";
+		} else {
+			uint8_t buf[128*1024];
+			const int n = sqlite3_blob_bytes(f->content);
+			for ( int off = 0; off < n && problem == NULL; off += sizeof(buf) ) {
+				const int k = n - off < (int) sizeof(buf) ? n - off : (int) sizeof(buf);
+				if ( sqlite3_blob_read(f->content, buf, k, off) != SQLITE_OK ) {
+					fprintf(stderr, "failed to read from blob : %s\n", sqlite3_errmsg(f->db));
+					*status = EX_IOERR;
+					problem = "content is unreadable";
+				}
+				EVP_DigestUpdate(hash, buf, k);
+			}
+			len = n;
+		}
+	} else {
+		inflater_t *z = &f->inflater;
+		z->skip = 0;
+		z->left = INT64_MAX;
+		z->sink = digest_sink;
+		z->ctx = hash;
+		if ( sqlite3_bind_int64(f->select_chunks, 1, id) != SQLITE_OK ) {
+			fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(f->db));
+			*status = EX_SOFTWARE;
+		}
+		for ( sqlite3_int64 seq = 0; *status == 0 && problem == NULL && (rc = step(f->select_chunks)) == SQLITE_ROW; seq++ ) {
+			const uint8_t *data = sqlite3_column_blob(f->select_chunks, 1);
+			const int n = sqlite3_column_bytes(f->select_chunks, 1);
+			if ( sqlite3_column_int64(f->select_chunks, 0) != seq ) {
+				problem = "a chunk is missing";
+			} else if ( codec == CODEC_NONE ) {
+				EVP_DigestUpdate(hash, data, n);
+				len += n;
+			} else {
+				int r = start_frame(z, f->select_dict, dict);
+				if ( r == 0 )
+					r = inflate_frame(z, data, n);
+				if ( r == EX_DATAERR || (r == 0 && z->pending != 0) )
+					problem = "a chunk does not decompress";
+				else if ( r != 0 )
+					*status = r;
+			}
+		}
+		if ( *status == 0 && problem == NULL && rc != SQLITE_DONE ) {
+			fprintf(stderr, "failed to read chunks : %s\n", sqlite3_errmsg(f->db));
+			*status = EX_SOFTWARE;
+		}
+		sqlite3_reset(f->select_chunks);
+		if ( codec != CODEC_NONE )
+			len = INT64_MAX - z->left;
 	}
 
-	sqlite3_stmt *delete_file = NULL;
-	if ( sqlite3_prepare_v2(db, "DELETE FROM Files WHERE Name = ?;", -1, &delete_file, NULL) != SQLITE_OK ) {
-		fprintf(stderr, "failed to perpare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		sqlite3_finalize(delete_file);
-		exit(EX_SOFTWARE);
-	}
+	uint8_t digest[DIGEST_LEN];
+	finish_digest(hash, digest);
+	*bytes += len;
+	if ( problem != NULL || *status != 0 )
+		return problem;
+	if ( len != size )
+		return "size differs";
+	if ( sqlite3_column_bytes(blob, 1) != DIGEST_LEN || memcmp(sqlite3_column_blob(blob, 1), digest, DIGEST_LEN) != 0 )
+		return "digest differs";
+	return NULL;
+}
 
-	if ( sqlite3_bind_text(delete_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		sqlite3_finalize(delete_file);
-		exit(EX_SOFTWARE);
-	}
+// Reports a corrupt blob by the names of the files stored in it.
+int report_blob(sqlite3_stmt *select_names, sqlite3_int64 id, const char *problem) {
+	int rc, named = 0;
 
-	sqlite3_stmt *count_file = NULL;
-	if ( sqlite3_prepare_v2(db, "SELECT COUNT (*) FROM Files WHERE Name = ?;", -1, &count_file, NULL) != SQLITE_OK ) {
-		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		sqlite3_finalize(delete_file);
-		sqlite3_finalize(count_file);
-		exit(EX_SOFTWARE);
+	if ( sqlite3_bind_int64(select_names, 1, id) != SQLITE_OK ) {
+		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(sqlite3_db_handle(select_names)));
+		return EX_SOFTWARE;
 	}
-	if ( sqlite3_bind_text(count_file, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		sqlite3_finalize(delete_file);
-		sqlite3_finalize(count_file);
-		exit(EX_SOFTWARE);
+	while ( (rc = step(select_names)) == SQLITE_ROW ) {
+		printf("corrupt file\t%s\t%s\n", sqlite3_column_text(select_names, 0), problem);
+		named = 1;
 	}
-	
-	int count = 0;
-	if ( sqlite3_step(select_edge) == SQLITE_ROW ) {
-		count = sqlite3_column_int(select_edge, 0);
-	} else {
-                fprintf(stderr, "failed to count the edges attached to this file : %s\n", sqlite3_errmsg(db));
-                sqlite3_finalize(select_edge);
-		sqlite3_finalize(delete_file);
-		sqlite3_finalize(count_file);
-		exit(EX_SOFTWARE);
+	sqlite3_reset(select_names);
+	if ( rc != SQLITE_DONE ) {
+		fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(sqlite3_db_handle(select_names)));
+		return EX_SOFTWARE;
 	}
-        sqlite3_finalize(select_edge);
-	if ( count != 0 ) {
-		fprintf(stderr, "The file named \"%s\" is attached to configs.\n", argv[3]);
-		sqlite3_finalize(delete_file);
-		sqlite3_finalize(count_file);
-		exit(1);
+	if ( !named )
+		printf("corrupt blob\t%lli\t%s\n", id, problem);
+	return 0;
+}
+
+void *fsck_worker(void *arg) {
+	fsck_worker_t *w = arg;
+	fsck_blob_t f = { .db = NULL };
+	sqlite3_stmt *select_blobs = NULL, *select_names = NULL;
+
+	if ( (w->status = open_worker_db(&f.db)) != 0 )
+		return NULL;
+	if ( check_plans > 0 && (check_plan(f.db, FSCK_BLOBS_SQL, NULL) || check_plan(f.db, FSCK_CHUNKS_SQL, NULL) ||
+	                         check_plan(f.db, FSCK_NAMES_SQL, NULL) || check_plan(f.db, SELECT_DICT_SQL, NULL)) ) {
+		w->status = EX_SOFTWARE;
+	} else if ( sqlite3_prepare_v2(f.db, FSCK_BLOBS_SQL, -1, &select_blobs, NULL) != SQLITE_OK ||
+	            sqlite3_prepare_v2(f.db, FSCK_CHUNKS_SQL, -1, &f.select_chunks, NULL) != SQLITE_OK ||
+	            sqlite3_prepare_v2(f.db, FSCK_NAMES_SQL, -1, &select_names, NULL) != SQLITE_OK ||
+	            sqlite3_prepare_v2(f.db, SELECT_DICT_SQL, -1, &f.select_dict, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(f.db));
+		w->status = EX_SOFTWARE;
 	}
 
-	int present = 0;
-	if ( sqlite3_step(count_file) == SQLITE_ROW ) {
-		present = sqlite3_column_int(count_file, 0);
-	} else {
-		fprintf(stderr, "failed to count file : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(delete_file);
-		sqlite3_finalize(count_file);
-		exit(EX_SOFTWARE);
+	while ( w->status == 0 ) {
+		pthread_mutex_lock(&w->queue->lock);
+		const sqlite3_int64 first = w->queue->next;
+		w->queue->next += FSCK_BATCH;
+		pthread_mutex_unlock(&w->queue->lock);
+		if ( first > w->queue->last )
+			break;
+
+		int rc;
+		if ( sqlite3_bind_int64(select_blobs, 1, first) != SQLITE_OK ||
+		     sqlite3_bind_int64(select_blobs, 2, first + FSCK_BATCH) != SQLITE_OK ) {
+			fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(f.db));
+			w->status = EX_SOFTWARE;
+			break;
+		}
+		while ( w->status == 0 && (rc = step(select_blobs)) == SQLITE_ROW ) {
+			const char *problem = fsck_blob(&f, select_blobs, &w->bytes, &w->status);
+			w->blobs++;
+			if ( problem != NULL ) {
+				w->corrupt++;
+				if ( w->status == 0 )
+					w->status = report_blob(select_names, sqlite3_column_int64(select_blobs, 0), problem);
+			}
+		}
+		if ( w->status == 0 && rc != SQLITE_DONE ) {
+			fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(f.db));
+			w->status = EX_SOFTWARE;
+		}
+		sqlite3_reset(select_blobs);
 	}
-	sqlite3_finalize(count_file);
-	if ( !present ) {
-        	fprintf(stderr, "Their is no file named \"%s\" to delete.\n", argv[3]);
-		sqlite3_finalize(delete_file);
-		exit(2);
+
+	sqlite3_blob_close(f.content);
+	free_inflater(&f.inflater);
+	sqlite3_finalize(select_blobs);
+	sqlite3_finalize(select_names);
+	sqlite3_finalize(f.select_chunks);
+	sqlite3_finalize(f.select_dict);
+	sqlite3_exec(f.db, "COMMIT;", NULL, NULL, NULL);
+	sqlite3_close(f.db);
+	return NULL;
+}
+
+// Compares name columns in the order of the indexes. Names are stored with
+// NUMERIC affinity, so names looking like numbers sort first by value.
+int cmp_names(sqlite3_stmt *a, int col_a, sqlite3_stmt *b, int col_b) {
+	const int type_a = sqlite3_column_type(a, col_a), type_b = sqlite3_column_type(b, col_b);
+	const int num_a = type_a == SQLITE_INTEGER || type_a == SQLITE_FLOAT;
+	const int num_b = type_b == SQLITE_INTEGER || type_b == SQLITE_FLOAT;
+
+	if ( num_a != num_b )
+		return num_a ? -1 : 1;
+	if ( type_a == SQLITE_INTEGER && type_b == SQLITE_INTEGER ) {
+		const sqlite3_int64 x = sqlite3_column_int64(a, col_a), y = sqlite3_column_int64(b, col_b);
+		return x < y ? -1 : x > y;
+	}
+	if ( num_a ) {
+		const double x = sqlite3_column_double(a, col_a), y = sqlite3_column_double(b, col_b);
+		return x < y ? -1 : x > y;
 	}
+	const unsigned char *x = sqlite3_column_text(a, col_a), *y = sqlite3_column_text(b, col_b);
+	const int len_x = sqlite3_column_bytes(a, col_a), len_y = sqlite3_column_bytes(b, col_b);
+	const int c = memcmp(x, y, len_x < len_y ? len_x : len_y);
+	return c != 0 ? c : len_x - len_y;
+}
 
-	if ( sqlite3_step(delete_file) != SQLITE_DONE ) {
-        	fprintf(stderr, "failed to delete the file named \"%s\" : %s\n", argv[3], sqlite3_errmsg(db));
-		sqlite3_finalize(delete_file);
-		exit(EX_SOFTWARE);
+// Steps one side of a merge join, returns 1 on a row and 0 at the end.
+int merge_step(sqlite3_stmt *stmt) {
+	switch ( step(stmt) ) {
+		case SQLITE_ROW:
+			return 1;
+		case SQLITE_DONE:
+			return 0;
+		default:
+			fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
+			rollback();
+			fail(EX_SOFTWARE);
+			return 0;
 	}
-	sqlite3_finalize(delete_file);
+}
 
-	if ( sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK ) {
-		fprintf(stderr, "failed to commit transaction %s\n", sqlite3_errmsg(db));
-		exit(EX_SOFTWARE);
+sqlite3_stmt *prepare_merge(const char *sql) {
+	sqlite3_stmt *stmt = NULL;
+	if ( prepare(sql, &stmt) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(stmt);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
+	return stmt;
 }
 
-void add_edge(int argc, const char *argv[]) {
-	if ( argc != 5 )
-		usage(argv[0]);
+typedef struct fsck_result {
+	size_t   errors;
+	size_t   repairable; // errors --repair fixes by deleting edges
+	size_t   warnings;
+	char   **files;     // files named by dangling edges
+	size_t   n_files;
+	size_t   files_cap;
+	char   **confs;     // configs with edges but no params
+	size_t   n_confs;
+	size_t   confs_cap;
+} fsck_result_t;
 
-	sqlite3_stmt *insert_edge = NULL;
-	if ( sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO Edges ( Name, File ) VALUES ( ?, ? );", -1, &insert_edge, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_edge);
-		exit(EX_SOFTWARE);
-	}
-	if ( sqlite3_bind_text(insert_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_edge);
-		exit(EX_SOFTWARE);
+// Edges by File against Files by Name finds edges to missing files and
+// files attached to no config.
+void merge_edge_files(fsck_result_t *res) {
+	sqlite3_stmt *edges = prepare_merge("SELECT File, Name FROM Edges ORDER BY File;");
+	sqlite3_stmt *files = prepare_merge("SELECT Name FROM Files ORDER BY Name;");
+	int has_edge = merge_step(edges), has_file = merge_step(files), attached = 0, c;
+
+	while ( has_edge || has_file ) {
+		c = !has_edge ? 1 : !has_file ? -1 : cmp_names(edges, 0, files, 0);
+		if ( c < 0 ) {
+			printf("dangling edge\t%s\t%s\n", sqlite3_column_text(edges, 1), sqlite3_column_text(edges, 0));
+			res->errors++;
+			res->repairable++;
+			if ( res->n_files == 0 || strcmp(res->files[res->n_files - 1], (const char*) sqlite3_column_text(edges, 0)) != 0 ) {
+				res->files = grow(res->files, res->n_files, &res->files_cap, sizeof(char*));
+				res->files[res->n_files++] = copy_text(sqlite3_column_text(edges, 0));
+			}
+			has_edge = merge_step(edges);
+		} else if ( c > 0 ) {
+			if ( !attached ) {
+				printf("orphan file\t%s\n", sqlite3_column_text(files, 0));
+				res->warnings++;
+			}
+			attached = 0;
+			has_file = merge_step(files);
+		} else {
+			attached = 1;
+			has_edge = merge_step(edges);
+		}
 	}
-        if ( sqlite3_bind_text(insert_edge, 2, argv[4], -1, SQLITE_STATIC) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_edge);
-		exit(EX_SOFTWARE);
+	release(edges);
+	release(files);
+}
+
+// Edges by Name against Params by Name finds attachments of configs
+// without any params.
+void merge_edge_params(fsck_result_t *res) {
+	sqlite3_stmt *edges = prepare_merge("SELECT DISTINCT Name FROM Edges ORDER BY Name;");
+	sqlite3_stmt *params = prepare_merge("SELECT DISTINCT Name FROM Params ORDER BY Name;");
+	int has_edge = merge_step(edges), has_param = merge_step(params), c;
+
+	while ( has_edge ) {
+		c = !has_param ? -1 : cmp_names(edges, 0, params, 0);
+		if ( c < 0 ) {
+			printf("config without params\t%s\n", sqlite3_column_text(edges, 0));
+			res->errors++;
+			res->repairable++;
+			res->confs = grow(res->confs, res->n_confs, &res->confs_cap, sizeof(char*));
+			res->confs[res->n_confs++] = copy_text(sqlite3_column_text(edges, 0));
+			has_edge = merge_step(edges);
+		} else if ( c > 0 ) {
+			has_param = merge_step(params);
+		} else {
+			has_edge = merge_step(edges);
+			has_param = merge_step(params);
+		}
 	}
+	release(edges);
+	release(params);
+}
 
-	if ( sqlite3_step(insert_edge) != SQLITE_DONE ) {
-		fprintf(stderr, "failed to insert edge : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(insert_edge);
-		exit(EX_SOFTWARE);
+// Files by Blob against Blobs by Id finds files without content and blobs
+// no file refers to.
+void merge_file_blobs(fsck_result_t *res) {
+	sqlite3_stmt *files = prepare_merge("SELECT Blob, Name FROM Files ORDER BY Blob;");
+	sqlite3_stmt *blobs = prepare_merge("SELECT Id FROM Blobs ORDER BY Id;");
+	int has_file = merge_step(files), has_blob = merge_step(blobs), used = 0;
+
+	while ( has_file || has_blob ) {
+		const sqlite3_int64 file_blob = has_file ? sqlite3_column_int64(files, 0) : INT64_MAX;
+		const sqlite3_int64 id = has_blob ? sqlite3_column_int64(blobs, 0) : INT64_MAX;
+		if ( !has_blob || (has_file && file_blob < id) ) {
+			printf("missing blob\t%s\t%lli\n", sqlite3_column_text(files, 1), file_blob);
+			res->errors++;
+			has_file = merge_step(files);
+		} else if ( !has_file || file_blob > id ) {
+			if ( !used ) {
+				printf("orphan blob\t%lli\n", id);
+				res->warnings++;
+			}
+			used = 0;
+			has_blob = merge_step(blobs);
+		} else {
+			used = 1;
+			has_file = merge_step(files);
+		}
 	}
-	sqlite3_finalize(insert_edge);
+	release(files);
+	release(blobs);
 }
 
-void del_edge(int argc, const char *argv[]) {
-	if ( argc != 5 )
-		usage(argv[0]);
-	
+// Deletes the edges matching each name, returns the number of rows deleted.
+int delete_edges(const char *sql, char **names, size_t n) {
 	sqlite3_stmt *delete_edge = NULL;
-	if ( sqlite3_prepare_v2(db, "DELETE FROM Edges WHERE Name = ? AND File = ?;", -1, &delete_edge, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(delete_edge);
-		exit(EX_SOFTWARE);
+	int deleted = 0;
+
+	if ( prepare(sql, &delete_edge) != SQLITE_OK ) {
+		fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+		release(delete_edge);
+		rollback();
+		fail(EX_SOFTWARE);
 	}
-	if ( sqlite3_bind_text(delete_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(delete_edge);
-		exit(EX_SOFTWARE);
+	for ( size_t i = 0; i < n; i++ ) {
+		if ( sqlite3_bind_text(delete_edge, 1, names[i], -1, SQLITE_STATIC) != SQLITE_OK ) {
+			fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
+			release(delete_edge);
+			rollback();
+			fail(EX_SOFTWARE);
+		}
+		if ( step(delete_edge) != SQLITE_DONE ) {
+			fprintf(stderr, "failed to delete edges : %s\n", sqlite3_errmsg(db));
+			release(delete_edge);
+			rollback();
+			fail(EX_SOFTWARE);
+		}
+		deleted += sqlite3_changes(db);
+		sqlite3_reset(delete_edge);
 	}
-	if ( sqlite3_bind_text(delete_edge, 2, argv[4], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(delete_edge);
-		exit(EX_SOFTWARE);
+	release(delete_edge);
+	return deleted;
+}
+
+void fsck(int argc, const char *argv[]) {
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int repair = 0;
+
+	for ( int i = 3; i < argc; i++ ) {
+		if ( strcmp(argv[i], "--repair") == 0 ) {
+			repair = 1;
+		} else if ( strcmp(argv[i], "--jobs") == 0 && i + 1 < argc ) {
+			char *end;
+			n_threads = strtol(argv[++i], &end, 10);
+			if ( *end != '\0' || n_threads < 1 || n_threads > 256 )
+				usage(argv[0]);
+		} else {
+			usage(argv[0]);
+		}
 	}
+	if ( n_threads < 1 )
+		n_threads = 1;
 
-	if ( sqlite3_step(delete_edge) != SQLITE_DONE ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(delete_edge);
-		exit(EX_SOFTWARE);
+	if ( begin() != SQLITE_OK ) {
+		fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+		fail(EX_SOFTWARE);
 	}
-	sqlite3_finalize(delete_edge);
-}
+	fsck_queue_t queue = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	sqlite3_stmt *select_range = prepare_merge("SELECT coalesce(min(Id), 1), coalesce(max(Id), 0) FROM Blobs;");
+	merge_step(select_range);
+	queue.next = sqlite3_column_int64(select_range, 0);
+	queue.last = sqlite3_column_int64(select_range, 1);
+	release(select_range);
 
-void list_edges(int argc, const char *argv[]) {
-	if ( argc != 4 )
-		usage(argv[0]);
+	fsck_worker_t workers[n_threads];
+	int started = 0;
+	for ( long i = 0; i < n_threads; i++ ) {
+		workers[i] = (fsck_worker_t) { .queue = &queue, .status = 0 };
+		if ( pthread_create(&workers[i].thread, NULL, fsck_worker, &workers[i]) != 0 ) {
+			fputs("failed to start worker threads.\n", stderr);
+			fail(EX_OSERR);
+		}
+		started++;
+	}
 
-	if ( sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK ) {
-		fprintf(stderr, "failed begin transaction : %s\n", sqlite3_errmsg(db));
-		exit(EX_SOFTWARE);
+	fsck_result_t res = { .errors = 0 };
+	merge_edge_files(&res);
+	merge_edge_params(&res);
+	merge_file_blobs(&res);
+	commit();
+
+	int status = 0;
+	sqlite3_int64 blobs = 0, bytes = 0;
+	for ( int i = 0; i < started; i++ ) {
+		pthread_join(workers[i].thread, NULL);
+		if ( status == 0 )
+			status = workers[i].status;
+		blobs += workers[i].blobs;
+		bytes += workers[i].bytes;
+		res.errors += workers[i].corrupt;
 	}
-	
-	sqlite3_stmt *select_edge = NULL;
-	if ( sqlite3_prepare_v2(db, "SELECT File FROM Edges WHERE Name = ?;", -1, &select_edge, NULL) != SQLITE_OK ) {
-        	fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-		exit(EX_SOFTWARE);
+	if ( status != 0 )
+		fail(status);
+
+	// Deleting the edges of every file and config found fixes all of the
+	// repairable errors. Corrupt and missing blobs stay errors.
+	size_t repaired = 0;
+	int deleted = 0;
+	if ( repair && res.n_files + res.n_confs > 0 ) {
+		if ( begin_write() != SQLITE_OK ) {
+			fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+			fail(EX_SOFTWARE);
+		}
+		deleted += delete_edges("DELETE FROM Edges WHERE File = ?;", res.files, res.n_files);
+		deleted += delete_edges("DELETE FROM Edges WHERE Name = ?;", res.confs, res.n_confs);
+		commit();
+		repaired = res.repairable;
 	}
-	if ( sqlite3_bind_text(select_edge, 1, argv[3], -1, SQLITE_STATIC) != SQLITE_OK ) {
-		fprintf(stderr, "failed to bind parameter to statement : %s\n", sqlite3_errmsg(db));
-		sqlite3_finalize(select_edge);
-		sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-		exit(EX_SOFTWARE);
+	for ( size_t i = 0; i < res.n_files; i++ )
+		free(res.files[i]);
+	for ( size_t i = 0; i < res.n_confs; i++ )
+		free(res.confs[i]);
+	free(res.files);
+	free(res.confs);
+
+	printf("checked %lli blobs with %lli bytes, %zu errors, %zu warnings", blobs, bytes, res.errors, res.warnings);
+	if ( repair )
+		printf(", repaired %zu errors by deleting %i edges", repaired, deleted);
+	printf(".\n");
+	if ( res.errors > repaired )
+		fail(1);
+}
+
+// concurrency <DB> [on|off] [--busy-timeout MS] [--mmap-size BYTES] stores
+// the settings applied by load_settings() and switches the journal mode.
+// Without arguments it prints the current settings.
+void set_concurrency(int argc, const char *argv[]) {
+	int mode = -1;
+
+	for ( int i = 3; i < argc; i++ ) {
+		if ( strcmp(argv[i], "on") == 0 )
+			mode = 1;
+		else if ( strcmp(argv[i], "off") == 0 )
+			mode = 0;
+		else if ( strcmp(argv[i], "--busy-timeout") == 0 && i + 1 < argc ) {
+			char *end;
+			const long ms = strtol(argv[++i], &end, 10);
+			if ( end == argv[i] || *end != '\0' || ms < 0 || ms > INT_MAX )
+				usage(argv[0]);
+			busy_timeout = (int) ms;
+		} else if ( strcmp(argv[i], "--mmap-size") == 0 && i + 1 < argc )
+			mmap_size = parse_bytes(argv[++i], argv[0]);
+		else
+			usage(argv[0]);
 	}
-	
-	int is_empty = 1;
-	while ( 1 ) {
-		switch ( sqlite3_step(select_edge) ) {
-			case SQLITE_DONE:
-				sqlite3_finalize(select_edge);
-				sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
-				if ( is_empty ) {
-					fprintf(stderr, "Their is no file attached to the config named \"%s\".\n", argv[3]);
-					exit(1);
-				}
-				return;
-			
-			case SQLITE_ROW: {
-				const unsigned char *file = sqlite3_column_text(select_edge, 0);
-				is_empty = 0;
 
-                                if ( printf("%s\n", file) < 0 ) {
-					sqlite3_finalize(select_edge);
-					fputs("failed to write to standard output.\n", stderr);
-					exit(EX_IOERR);
-				}
-				break;
+	if ( argc > 3 ) {
+		if ( mode >= 0 )
+			concurrent = mode;
+
+		sqlite3_stmt *insert_setting = NULL;
+		if ( prepare("INSERT OR REPLACE INTO Settings ( Name, Value ) VALUES ( ?, ? );", &insert_setting) != SQLITE_OK ) {
+			fprintf(stderr, "failed to prepare statement : %s\n", sqlite3_errmsg(db));
+			release(insert_setting);
+			fail(EX_SOFTWARE);
+		}
+		if ( begin_write() != SQLITE_OK ) {
+			fprintf(stderr, "failed to begin transaction : %s\n", sqlite3_errmsg(db));
+			release(insert_setting);
+			fail(EX_SOFTWARE);
+		}
+		const char *const names[] = { "concurrent", "busy-timeout", "mmap-size" };
+		const sqlite3_int64 values[] = { concurrent, busy_timeout, mmap_size };
+		for ( int i = 0; i < 3; i++ ) {
+			if ( sqlite3_bind_text(insert_setting, 1, names[i], -1, SQLITE_STATIC) != SQLITE_OK ||
+			     sqlite3_bind_int64(insert_setting, 2, values[i]) != SQLITE_OK ) {
+				fprintf(stderr, "failed to bind parameter : %s\n", sqlite3_errmsg(db));
+				release(insert_setting);
+				rollback();
+				fail(EX_SOFTWARE);
+			}
+			if ( step(insert_setting) != SQLITE_DONE ) {
+				fprintf(stderr, "failed to store setting : %s\n", sqlite3_errmsg(db));
+				release(insert_setting);
+				rollback();
+				fail(EX_SOFTWARE);
 			}
+			sqlite3_reset(insert_setting);
+		}
+		release(insert_setting);
+		if ( commit() != SQLITE_OK ) {
+			fprintf(stderr, "failed to commit transaction : %s\n", sqlite3_errmsg(db));
+			rollback();
+			fail(EX_SOFTWARE);
+		}
 
-			default:
-				fprintf(stderr, "failed to step trough result set : %s\n", sqlite3_errmsg(db));
-				sqlite3_finalize(select_edge);
-				sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-				exit(EX_SOFTWARE);
-				break;
+		// The journal mode is stored in the database file itself and can
+		// only change outside of a transaction.
+		if ( mode >= 0 && sqlite3_exec(db, mode ? "PRAGMA journal_mode = WAL;" : "PRAGMA journal_mode = DELETE;", NULL, NULL, NULL) != SQLITE_OK ) {
+			fprintf(stderr, "failed to change journal mode : %s\n", sqlite3_errmsg(db));
+			fail(EX_SOFTWARE);
 		}
 	}
-}                                            
 
-void write_archive(int argc, const char *argv[]) {
-	if ( argc != 4 ) {
-		usage(argv[0]);
+	sqlite3_stmt *select_mode = NULL;
+	if ( prepare("PRAGMA journal_mode;", &select_mode) != SQLITE_OK || step(select_mode) != SQLITE_ROW ) {
+		fprintf(stderr, "failed to read journal mode : %s\n", sqlite3_errmsg(db));
+		release(select_mode);
+		fail(EX_SOFTWARE);
 	}
-
-	struct archive       *a;
-	struct archive_entry *entry;
-	struct stat           st = { 0 };
-	char                  buff[8192];
-	int                   len;
-	int                   fd;
-	a = archive_write_new();
-	archive_write_set_compression_gzip(a);
-	archive_write_set_format_pax_restricted(a);
-	archive_write_open_fd(a, 1);
-
-	entry = archive_entry_new();
-	archive_entry_set_pathname(entry, "foo");
-	archive_entry_set_size(entry, strlen("test"));
-	archive_entry_set_filetype(entry, AE_IFREG);
-	archive_entry_set_perm(entry, 0644);
-	archive_write_header(a, entry);
-	archive_write_data(a, "test", strlen("test"));
-	archive_entry_free(entry);
-
-	archive_write_close(a);
-	archive_write_finish(a);
+	printf("concurrent %s\n", concurrent ? "on" : "off");
+	printf("journal-mode %s\n", sqlite3_column_text(select_mode, 0));
+	printf("busy-timeout %i\n", busy_timeout);
+	printf("mmap-size %lli\n", mmap_size);
+	release(select_mode);
 }
 
-
-int main(int argc, const char *argv[]) {
-	if ( argc < 2 || get_verb(argv[1]) )
+// explain <DB> <SQL> prints the query plan of a statement, marking the steps
+// check_plan() rejects with "!", and fails if there are any.
+void explain(int argc, const char *argv[]) {
+	if ( argc != 4 )
 		usage(argv[0]);
 
-	get_db(argc, argv);
-	init_db();
+	if ( check_plan(db, argv[3], stdout) )
+		fail(EX_SOFTWARE);
+}
+
+void run_verb(int argc, const char *argv[]) {
 	switch ( verb ) {
         	case init:
 			break;
@@ -958,6 +6221,10 @@ int main(int argc, const char *argv[]) {
 			store_file(argc, argv);
 			break;
 
+		case put_files_:
+			put_files(argc, argv);
+			break;
+
 		case get_file:
 			retrieve_file(argc, argv);
 			break;
@@ -981,14 +6248,252 @@ int main(int argc, const char *argv[]) {
 		case list_attached:
 			list_edges(argc, argv);
 			break;
+
+		case find_:
+			find_params(argc, argv);
+			break;
+
+		case users_of_:
+			users_of(argc, argv);
+			break;
 		
 		case tar:
 			write_archive(argc, argv);
 			break;
 
+		case export_all_:
+			export_all(argc, argv);
+			break;
+
+		case export_:
+			export_since(argc, argv);
+			break;
+
+		case render_:
+			render(argc, argv);
+			break;
+
+		case render_all_:
+			render_all(argc, argv);
+			break;
+
+		case fsck_:
+			fsck(argc, argv);
+			break;
+
+		case import_dir_:
+			import_dir(argc, argv);
+			break;
+
+		case concurrency:
+			set_concurrency(argc, argv);
+			break;
+
+		case serve_:
+			serve(argc, argv);
+			break;
+
+		case explain_:
+			explain(argc, argv);
+			break;
+
+		case train_dict_:
+			train_dict(argc, argv);
+			break;
+
 		default:
 			usage(argv[0]);
 			break;
 	}
+}
+
+// Reads the config body of a batched read up to a line containing only ".".
+FILE *read_body(char **body) {
+	char *line = NULL;
+	size_t linecap = 0, body_len = 0;
+	ssize_t linelen;
+	FILE *out = open_memstream(body, &body_len);
+
+	if ( out == NULL ) {
+		perror("failed to open memory stream");
+		exit(EX_OSERR);
+	}
+	while ( (linelen = getline(&line, &linecap, stdin)) > 0 ) {
+		if ( strcmp(line, ".\n") == 0 || strcmp(line, ".") == 0 )
+			break;
+		fputs(line, out);
+	}
+	free(line);
+	if ( fclose(out) ) {
+		perror("failed to close memory stream");
+		exit(EX_OSERR);
+	}
+
+	FILE *in = fmemopen(*body, body_len, "r");
+	if ( in == NULL && body_len == 0 )
+		in = fopen("/dev/null", "r");
+	if ( in == NULL ) {
+		perror("failed to open memory stream");
+		exit(EX_OSERR);
+	}
+	return in;
+}
+
+void batch_exec(const char *sql) {
+	if ( sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK ) {
+		fprintf(stderr, "failed to execute \"%s\" : %s\n", sql, sqlite3_errmsg(db));
+		exit(EX_SOFTWARE);
+	}
+}
+
+// Taking the write lock up front lets the busy handler wait for it,
+// upgrading a WAL read transaction later fails right away.
+void batch_begin(void) {
+	batch_exec(concurrent ? "BEGIN IMMEDIATE;" : "BEGIN;");
+	txn_depth = 1;
+	txn_immediate = 0;
+	txn_changes = sqlite3_total_changes(db);
+}
+
+void batch_commit(void) {
+	bump_generation();
+	batch_exec("COMMIT;");
+	txn_depth = 0;
+}
+
+// Runs newline-delimited verbs from stdin on the one open connection. Every
+// command runs in its own savepoint and is answered with "ok" or
+// "error <STATUS>" after its output. Commands are grouped into transactions
+// committed on a "commit" line, every <N> commands and at end of input.
+void batch(int argc, const char *argv[]) {
+	if ( argc != 3 && argc != 4 )
+		usage(argv[0]);
+
+	long commit_every = 0;
+	if ( argc == 4 ) {
+		char *end;
+		commit_every = strtol(argv[3], &end, 10);
+		if ( *argv[3] == '\0' || *end != '\0' || commit_every < 0 )
+			usage(argv[0]);
+	}
+
+	char *line = NULL;
+	size_t linecap = 0;
+	long pending = 0;
+	while ( getline(&line, &linecap, stdin) > 0 ) {
+		const char *args[32] = { argv[0], NULL, db_path };
+		int n = 1;
+		char *rest = line, *token;
+
+		while ( (token = strsep(&rest, " \t\n")) != NULL ) {
+			if ( *token == '\0' )
+				continue;
+			if ( n == sizeof(args) / sizeof(args[0]) )
+				break;
+			args[n++] = token;
+			if ( n == 2 )
+				n++;
+		}
+		if ( n == 1 || *args[1] == '#' )
+			continue;
+
+		if ( strcmp(args[1], "commit") == 0 ) {
+			if ( pending )
+				batch_commit();
+			pending = 0;
+			puts("ok");
+			fflush(stdout);
+			continue;
+		}
+
+		// Verbs consuming stdin would eat the rest of the batch, import-dir,
+		// render-all and fsck can't be unwound while their workers run and
+		// serve never returns.
+		if ( get_verb(args[1]) || verb == batch_ || verb == put_file || verb == put_files_ || verb == import_dir_ ||
+		     verb == render_all_ || verb == fsck_ || verb == serve_ || verb == query_ ) {
+			fprintf(stderr, "unsupported verb \"%s\" in batch.\n", args[1]);
+			printf("error %i\n", EX_USAGE);
+			fflush(stdout);
+			continue;
+		}
+
+		char *buf = NULL;
+		const int sync_params = verb == read_ && n == 5 && strcmp(args[4], "--sync") == 0;
+		FILE *volatile body = verb == read_ && (n == 4 || sync_params) ? read_body(&buf) : NULL;
+		if ( !pending )
+			batch_begin();
+		batch_exec("SAVEPOINT command;");
+
+		jmp_buf env;
+		int status = setjmp(env);
+		if ( status == 0 ) {
+			fail_env = &env;
+			if ( body != NULL )
+				load_conf(args[3], body, sync_params);
+			else
+				run_verb(n, args);
+			fail_env = NULL;
+			batch_exec("RELEASE command;");
+		} else {
+			fail_env = NULL;
+			release_all();
+			release_owned();
+			discard_out();
+			batch_exec("ROLLBACK TO command; RELEASE command;");
+			txn_depth = 1;
+		}
+		if ( body != NULL )
+			fclose(body);
+		free(buf);
+
+		report_lock_wait();
+		if ( status == 0 )
+			puts("ok");
+		else
+			printf("error %i\n", status);
+		fflush(stdout);
+
+		if ( ++pending == commit_every ) {
+			batch_commit();
+			pending = 0;
+		}
+	}
+	free(line);
+
+	if ( ferror(stdin) ) {
+		fputs("failed to read from stdin.\n", stderr);
+		exit(EX_IOERR);
+	}
+	if ( pending )
+		batch_commit();
+}
+
+int main(int argc, const char *argv[]) {
+	stats.started = now();
+	stats.enabled = getenv("OPENVPN_DB_STATS") != NULL;
+	if ( argc > 1 && strcmp(argv[1], "--stats") == 0 ) {
+		stats.enabled = 1;
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+	if ( argc < 2 || get_verb(argv[1]) )
+		usage(argv[0]);
+	stats.verb = argv[1];
+
+	// The client never opens the database.
+	if ( verb == query_ ) {
+		query(argc, argv);
+		return 0;
+	}
+
+	get_db(argc, argv);
+	const double t = stats_clock();
+	init_db();
+	stats.schema += stats_clock() - t;
+	if ( verb == batch_ )
+		batch(argc, argv);
+	else
+		run_verb(argc, argv);
 	return 0;
 }